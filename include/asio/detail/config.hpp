@@ -961,6 +961,30 @@
 # define ASIO_THREAD_KEYWORD __thread
 #endif // !defined(ASIO_THREAD_KEYWORD)
 
+// Support for the C++11 thread_local keyword, whose objects are destroyed
+// when their thread exits.
+#if !defined(ASIO_HAS_THREAD_LOCAL)
+# if !defined(ASIO_DISABLE_THREAD_LOCAL)
+#  if defined(__clang__)
+#   if __has_feature(__cxx_thread_local__)
+#    define ASIO_HAS_THREAD_LOCAL 1
+#   endif // __has_feature(__cxx_thread_local__)
+#  endif // defined(__clang__)
+#  if defined(__GNUC__)
+#   if ((__GNUC__ == 4) && (__GNUC_MINOR__ >= 8)) || (__GNUC__ > 4)
+#    if defined(__GXX_EXPERIMENTAL_CXX0X__)
+#     define ASIO_HAS_THREAD_LOCAL 1
+#    endif // defined(__GXX_EXPERIMENTAL_CXX0X__)
+#   endif // ((__GNUC__ == 4) && (__GNUC_MINOR__ >= 8)) || (__GNUC__ > 4)
+#  endif // defined(__GNUC__)
+#  if defined(ASIO_MSVC)
+#   if (_MSC_VER >= 1900)
+#    define ASIO_HAS_THREAD_LOCAL 1
+#   endif // (_MSC_VER >= 1900)
+#  endif // defined(ASIO_MSVC)
+# endif // !defined(ASIO_DISABLE_THREAD_LOCAL)
+#endif // !defined(ASIO_HAS_THREAD_LOCAL)
+
 // Support for POSIX ssize_t typedef.
 #if !defined(ASIO_DISABLE_SSIZE_T)
 # if defined(__linux__) \
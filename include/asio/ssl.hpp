@@ -20,6 +20,7 @@
 #include "asio/ssl/context_base.hpp"
 #include "asio/ssl/context_service.hpp"
 #include "asio/ssl/error.hpp"
+#include "asio/ssl/handshake_pool.hpp"
 #include "asio/ssl/rfc2818_verification.hpp"
 #include "asio/ssl/stream.hpp"
 #include "asio/ssl/stream_base.hpp"
@@ -694,6 +694,20 @@ public:
   ASIO_DECL asio::error_code use_tmp_dh_file(
       const std::string& filename, asio::error_code& ec);
 
+  /// Prepare the server streams of the context for kernel TLS.
+  /**
+   * This function may be used to allow streams using the context to hand the
+   * encryption of the records they write to the kernel with
+   * stream::set_kernel_send(). Server streams then keep the TLS 1.3 traffic
+   * secret and count the records they send from their handshake on, which
+   * the kernel needs to take over. Without it set_kernel_send() fails.
+   *
+   * @note Calls @c SSL_CTX_set_keylog_callback, replacing any keylog
+   * callback of the context, and @c SSL_set_msg_callback on the server
+   * streams, replacing any message callback they inherited from it.
+   */
+  ASIO_DECL void enable_kernel_send();
+
   /// Set the password callback.
   /**
    * This function is used to specify a callback function to obtain password
@@ -758,6 +772,16 @@ private:
   ASIO_DECL static int password_callback_function(
       char* buf, int size, int purpose, void* data);
 
+  // Helper functions to get the password callback and its user data, which
+  // are opaque from OpenSSL 1.1 on.
+  ASIO_DECL pem_password_cb* get_password_callback();
+  ASIO_DECL void* get_password_callback_userdata();
+
+#if (OPENSSL_VERSION_NUMBER >= 0x10100000L)
+  // Helper function to allow a single protocol version only.
+  ASIO_DECL void set_protocol_version(int version);
+#endif // (OPENSSL_VERSION_NUMBER >= 0x10100000L)
+
   // Helper function to set the temporary Diffie-Hellman parameters from a BIO.
   ASIO_DECL asio::error_code do_use_tmp_dh(
       BIO* bio, asio::error_code& ec);
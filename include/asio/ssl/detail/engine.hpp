@@ -19,6 +19,7 @@
 
 #if !defined(ASIO_ENABLE_OLD_SSL)
 # include "asio/buffer.hpp"
+# include "asio/detail/cstdint.hpp"
 # include "asio/detail/static_mutex.hpp"
 # include "asio/ssl/detail/openssl_types.hpp"
 # include "asio/ssl/detail/verify_callback.hpp"
@@ -26,6 +27,18 @@
 # include "asio/ssl/verify_mode.hpp"
 #endif // !defined(ASIO_ENABLE_OLD_SSL)
 
+// Kernel TLS: the kernel encrypts the records written to a socket once the
+// keys are installed with setsockopt(SOL_TLS). Linux only, and OpenSSL 1.1.1
+// or later for the keylog callback and HKDF.
+#if !defined(ASIO_HAS_SSL_KERNEL_TLS)
+# if !defined(ASIO_DISABLE_SSL_KERNEL_TLS)
+#  if !defined(ASIO_ENABLE_OLD_SSL) && defined(__linux__) \
+    && (OPENSSL_VERSION_NUMBER >= 0x10101000L)
+#   define ASIO_HAS_SSL_KERNEL_TLS 1
+#  endif // !defined(ASIO_ENABLE_OLD_SSL) && defined(__linux__) ...
+# endif // !defined(ASIO_DISABLE_SSL_KERNEL_TLS)
+#endif // !defined(ASIO_HAS_SSL_KERNEL_TLS)
+
 #include "asio/detail/push_options.hpp"
 
 namespace asio {
@@ -110,6 +123,39 @@ public:
   ASIO_DECL const asio::error_code& map_error_code(
       asio::error_code& ec) const;
 
+  // The size of the records the first data written goes out in when records
+  // are sized dynamically. Header, nonce and tag included, such a record
+  // fits the payload of a single TCP segment on Ethernet, so that the peer
+  // can decrypt it as soon as that segment arrives.
+  enum { small_record_size = 1400 };
+
+  // Size records dynamically: the next bytes written, up to the given number,
+  // go out in records of small_record_size, and those after them in records
+  // of the maximum size. Zero writes records of the maximum size throughout.
+  ASIO_DECL void set_dynamic_record_sizing(std::size_t small_bytes);
+
+  // Hand the encryption of the records written from now on to the kernel's
+  // TLS on the given socket, after a completed handshake. Fails with
+  // operation_not_supported, discarding the secret kept for it, if the
+  // context, the kernel, the protocol version or the cipher rule it out.
+  ASIO_DECL asio::error_code set_kernel_send(
+      int descriptor, asio::error_code& ec);
+
+  // Whether the kernel encrypts the records written, so that plain data is
+  // to be written straight to the transport.
+  bool kernel_send() const
+  {
+    return kernel_send_;
+  }
+
+#if defined(ASIO_HAS_SSL_KERNEL_TLS)
+  // Callback used when the SSL implementation logs a secret, installed on
+  // the contexts that enable kernel sending. Keeps the TLS 1.3 secret of the
+  // traffic sent.
+  ASIO_DECL static void keylog_callback_function(
+      const SSL* ssl, const char* line);
+#endif // defined(ASIO_HAS_SSL_KERNEL_TLS)
+
 private:
   // Disallow copying and assignment.
   engine(const engine&);
@@ -119,9 +165,11 @@ private:
   ASIO_DECL static int verify_callback_function(
       int preverified, X509_STORE_CTX* ctx);
 
-  // The SSL_accept function may not be thread safe. This mutex is used to
-  // protect all calls to the SSL_accept function.
+#if (OPENSSL_VERSION_NUMBER < 0x10100000L)
+  // The SSL_accept function may not be thread safe before OpenSSL 1.1.0.
+  // This mutex is used to protect all calls to the SSL_accept function.
   ASIO_DECL static asio::detail::static_mutex& accept_mutex();
+#endif // (OPENSSL_VERSION_NUMBER < 0x10100000L)
 
   // Perform one operation. Returns >= 0 on success or error, want_read if the
   // operation needs more input, or want_write if it needs to write some output
@@ -145,8 +193,28 @@ private:
   // Adapt the SSL_write function to the signature needed for perform().
   ASIO_DECL int do_write(void* data, std::size_t length);
 
+#if defined(ASIO_HAS_SSL_KERNEL_TLS)
+  // The index of the engine in the ex_data of its SSL.
+  ASIO_DECL static int ex_data_index();
+
+  // Callback used for every protocol message and record header. Counts the
+  // records sent under the current key, whose number is the sequence number
+  // the kernel has to continue from.
+  ASIO_DECL static void message_callback_function(int write_p, int version,
+      int content_type, const void* buf, std::size_t len, SSL* ssl,
+      void* arg);
+#endif // defined(ASIO_HAS_SSL_KERNEL_TLS)
+
   SSL* ssl_;
   BIO* ext_bio_;
+  std::size_t small_record_bytes_;
+  bool kernel_send_;
+#if defined(ASIO_HAS_SSL_KERNEL_TLS)
+  unsigned char send_secret_[EVP_MAX_MD_SIZE];
+  std::size_t send_secret_length_;
+  uint64_t records_sent_;
+  bool records_counted_;
+#endif // defined(ASIO_HAS_SSL_KERNEL_TLS)
 };
 
 #endif // !defined(ASIO_ENABLE_OLD_SSL)
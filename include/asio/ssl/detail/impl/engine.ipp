@@ -25,6 +25,21 @@
 # include "asio/ssl/verify_context.hpp"
 #endif // !defined(ASIO_ENABLE_OLD_SSL)
 
+#if defined(ASIO_HAS_SSL_KERNEL_TLS)
+# include <cstring>
+# include <netinet/in.h>
+# include <netinet/tcp.h>
+# include <sys/socket.h>
+# include <linux/tls.h>
+# include <openssl/kdf.h>
+# if !defined(TCP_ULP)
+#  define TCP_ULP 31
+# endif // !defined(TCP_ULP)
+# if !defined(SOL_TLS)
+#  define SOL_TLS 282
+# endif // !defined(SOL_TLS)
+#endif // defined(ASIO_HAS_SSL_KERNEL_TLS)
+
 #include "asio/detail/push_options.hpp"
 
 namespace asio {
@@ -33,8 +48,221 @@ namespace detail {
 
 #if !defined(ASIO_ENABLE_OLD_SSL)
 
+#if defined(ASIO_HAS_SSL_KERNEL_TLS)
+namespace kernel_tls {
+
+// Any of the structures setsockopt(SOL_TLS, TLS_TX) takes.
+union crypto_info
+{
+  tls_crypto_info info;
+  tls12_crypto_info_aes_gcm_128 aes_gcm_128;
+  tls12_crypto_info_aes_gcm_256 aes_gcm_256;
+# if defined(TLS_CIPHER_CHACHA20_POLY1305)
+  tls12_crypto_info_chacha20_poly1305 chacha20_poly1305;
+# endif // defined(TLS_CIPHER_CHACHA20_POLY1305)
+};
+
+// HKDF-Expand-Label of TLS 1.3 (RFC 8446, 7.1), with an empty context.
+inline bool expand_label(const EVP_MD* md, const unsigned char* secret,
+    std::size_t secret_length, const char* label, unsigned char* out,
+    std::size_t out_length)
+{
+  static const char prefix[] = "tls13 ";
+  std::size_t label_length = sizeof(prefix) - 1 + std::strlen(label);
+  unsigned char info[4 + 255];
+  if (label_length > 255)
+    return false;
+  info[0] = static_cast<unsigned char>(out_length >> 8);
+  info[1] = static_cast<unsigned char>(out_length);
+  info[2] = static_cast<unsigned char>(label_length);
+  std::memcpy(info + 3, prefix, sizeof(prefix) - 1);
+  std::memcpy(info + 3 + sizeof(prefix) - 1, label, std::strlen(label));
+  info[3 + label_length] = 0;
+
+  EVP_PKEY_CTX* ctx = ::EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, 0);
+  bool result = ctx
+    && ::EVP_PKEY_derive_init(ctx) > 0
+    && ::EVP_PKEY_CTX_hkdf_mode(ctx, EVP_PKEY_HKDEF_MODE_EXPAND_ONLY) > 0
+    && ::EVP_PKEY_CTX_set_hkdf_md(ctx, md) > 0
+    && ::EVP_PKEY_CTX_set1_hkdf_key(ctx, secret,
+        static_cast<int>(secret_length)) > 0
+    && ::EVP_PKEY_CTX_add1_hkdf_info(ctx, info,
+        static_cast<int>(4 + label_length)) > 0
+    && ::EVP_PKEY_derive(ctx, out, &out_length) > 0;
+  ::EVP_PKEY_CTX_free(ctx);
+  return result;
+}
+
+// The key block of TLS 1.2 (RFC 5246, 6.3), from the master secret.
+inline bool key_block(SSL* ssl, const EVP_MD* md, unsigned char* out,
+    std::size_t length)
+{
+  unsigned char master[SSL_MAX_MASTER_KEY_LENGTH];
+  std::size_t master_length = ::SSL_SESSION_get_master_key(
+      ::SSL_get_session(ssl), master, sizeof(master));
+  unsigned char seed[2 * SSL3_RANDOM_SIZE];
+  ::SSL_get_server_random(ssl, seed, SSL3_RANDOM_SIZE);
+  ::SSL_get_client_random(ssl, seed + SSL3_RANDOM_SIZE, SSL3_RANDOM_SIZE);
+  static const unsigned char label[] = "key expansion";
+
+  EVP_PKEY_CTX* ctx = ::EVP_PKEY_CTX_new_id(EVP_PKEY_TLS1_PRF, 0);
+  bool result = ctx && master_length > 0
+    && ::EVP_PKEY_derive_init(ctx) > 0
+    && ::EVP_PKEY_CTX_set_tls1_prf_md(ctx, md) > 0
+    && ::EVP_PKEY_CTX_set1_tls1_prf_secret(ctx, master,
+        static_cast<int>(master_length)) > 0
+    && ::EVP_PKEY_CTX_add1_tls1_prf_seed(ctx, label, sizeof(label) - 1) > 0
+    && ::EVP_PKEY_CTX_add1_tls1_prf_seed(ctx, seed, sizeof(seed)) > 0
+    && ::EVP_PKEY_derive(ctx, out, &length) > 0;
+  ::EVP_PKEY_CTX_free(ctx);
+  ::OPENSSL_cleanse(master, sizeof(master));
+  return result;
+}
+
+// Fills in the key, nonce and sequence number the side of ssl that sends
+// continues with. secret is that side's TLS 1.3 traffic secret. Returns the
+// size of the structure filled in, or 0 if the kernel cannot take over.
+inline std::size_t make_crypto_info(SSL* ssl, const unsigned char* secret,
+    std::size_t secret_length, uint64_t sequence, crypto_info& info)
+{
+  const SSL_CIPHER* cipher = ::SSL_get_current_cipher(ssl);
+  if (!cipher)
+    return 0;
+
+  // The kernel takes the 12 byte nonce of an AES-GCM record as a 4 byte salt
+  // and an 8 byte IV, and that of ChaCha20-Poly1305 whole.
+  unsigned short cipher_type;
+  std::size_t key_length, salt_length, iv_length;
+  switch (::SSL_CIPHER_get_cipher_nid(cipher))
+  {
+  case NID_aes_128_gcm:
+    cipher_type = TLS_CIPHER_AES_GCM_128;
+    key_length = TLS_CIPHER_AES_GCM_128_KEY_SIZE;
+    salt_length = TLS_CIPHER_AES_GCM_128_SALT_SIZE;
+    iv_length = TLS_CIPHER_AES_GCM_128_IV_SIZE;
+    break;
+  case NID_aes_256_gcm:
+    cipher_type = TLS_CIPHER_AES_GCM_256;
+    key_length = TLS_CIPHER_AES_GCM_256_KEY_SIZE;
+    salt_length = TLS_CIPHER_AES_GCM_256_SALT_SIZE;
+    iv_length = TLS_CIPHER_AES_GCM_256_IV_SIZE;
+    break;
+# if defined(TLS_CIPHER_CHACHA20_POLY1305)
+  case NID_chacha20_poly1305:
+    cipher_type = TLS_CIPHER_CHACHA20_POLY1305;
+    key_length = TLS_CIPHER_CHACHA20_POLY1305_KEY_SIZE;
+    salt_length = 0;
+    iv_length = TLS_CIPHER_CHACHA20_POLY1305_IV_SIZE;
+    break;
+# endif // defined(TLS_CIPHER_CHACHA20_POLY1305)
+  default:
+    return 0;
+  }
+
+  // The key and the fixed part of the nonce, which in TLS 1.2 AES-GCM is
+  // just the salt: the rest goes with every record, and the kernel counts
+  // it up from the sequence number, as unique for the key as it has to be.
+  const EVP_MD* md = ::SSL_CIPHER_get_handshake_digest(cipher);
+  unsigned char key[32];
+  unsigned char fixed[12];
+  std::size_t fixed_length = salt_length + iv_length;
+  bool server = ::SSL_is_server(ssl) != 0;
+  unsigned short version;
+  switch (::SSL_version(ssl))
+  {
+  case TLS1_2_VERSION:
+    {
+      if (salt_length > 0)
+        fixed_length = salt_length;
+
+      // Client key, server key, client IV, server IV; AEADs have no MAC key.
+      unsigned char block[2 * (32 + 12)];
+      std::size_t length = 2 * (key_length + fixed_length);
+      if (!key_block(ssl, md, block, length))
+        return 0;
+      std::memcpy(key, block + (server ? key_length : 0), key_length);
+      std::memcpy(fixed, block + 2 * key_length
+          + (server ? fixed_length : 0), fixed_length);
+      ::OPENSSL_cleanse(block, sizeof(block));
+      version = TLS_1_2_VERSION;
+    }
+    break;
+# if defined(TLS_1_3_VERSION)
+  case TLS1_3_VERSION:
+    if (secret_length == 0
+        || !expand_label(md, secret, secret_length, "key", key, key_length)
+        || !expand_label(md, secret, secret_length, "iv", fixed,
+          fixed_length))
+      return 0;
+    version = TLS_1_3_VERSION;
+    break;
+# endif // defined(TLS_1_3_VERSION)
+  default:
+    return 0;
+  }
+
+  unsigned char rec_seq[8];
+  for (int i = 7; i >= 0; --i, sequence >>= 8)
+    rec_seq[i] = static_cast<unsigned char>(sequence);
+
+  std::memset(&info, 0, sizeof(info));
+  info.info.version = version;
+  info.info.cipher_type = cipher_type;
+  unsigned char* info_salt;
+  unsigned char* info_iv;
+  unsigned char* info_key;
+  unsigned char* info_rec_seq;
+  std::size_t size;
+  switch (cipher_type)
+  {
+  case TLS_CIPHER_AES_GCM_128:
+    info_salt = info.aes_gcm_128.salt;
+    info_iv = info.aes_gcm_128.iv;
+    info_key = info.aes_gcm_128.key;
+    info_rec_seq = info.aes_gcm_128.rec_seq;
+    size = sizeof(info.aes_gcm_128);
+    break;
+# if defined(TLS_CIPHER_CHACHA20_POLY1305)
+  case TLS_CIPHER_CHACHA20_POLY1305:
+    info_salt = info.chacha20_poly1305.salt;
+    info_iv = info.chacha20_poly1305.iv;
+    info_key = info.chacha20_poly1305.key;
+    info_rec_seq = info.chacha20_poly1305.rec_seq;
+    size = sizeof(info.chacha20_poly1305);
+    break;
+# endif // defined(TLS_CIPHER_CHACHA20_POLY1305)
+  default:
+    info_salt = info.aes_gcm_256.salt;
+    info_iv = info.aes_gcm_256.iv;
+    info_key = info.aes_gcm_256.key;
+    info_rec_seq = info.aes_gcm_256.rec_seq;
+    size = sizeof(info.aes_gcm_256);
+    break;
+  }
+  std::memcpy(info_salt, fixed, salt_length);
+  if (fixed_length > salt_length)
+    std::memcpy(info_iv, fixed + salt_length, iv_length);
+  else
+    std::memcpy(info_iv, rec_seq, iv_length);
+  std::memcpy(info_key, key, key_length);
+  std::memcpy(info_rec_seq, rec_seq, sizeof(rec_seq));
+  ::OPENSSL_cleanse(key, sizeof(key));
+  ::OPENSSL_cleanse(fixed, sizeof(fixed));
+  return size;
+}
+
+} // namespace kernel_tls
+#endif // defined(ASIO_HAS_SSL_KERNEL_TLS)
+
 engine::engine(SSL_CTX* context)
-  : ssl_(::SSL_new(context))
+  : ssl_(::SSL_new(context)),
+    small_record_bytes_(0),
+    kernel_send_(false)
+#if defined(ASIO_HAS_SSL_KERNEL_TLS)
+    , send_secret_length_(0),
+    records_sent_(0),
+    records_counted_(false)
+#endif // defined(ASIO_HAS_SSL_KERNEL_TLS)
 {
   if (!ssl_)
   {
@@ -44,7 +272,9 @@ engine::engine(SSL_CTX* context)
     asio::detail::throw_error(ec, "engine");
   }
 
+#if (OPENSSL_VERSION_NUMBER < 0x10100000L)
   accept_mutex().init();
+#endif // (OPENSSL_VERSION_NUMBER < 0x10100000L)
 
   ::SSL_set_mode(ssl_, SSL_MODE_ENABLE_PARTIAL_WRITE);
   ::SSL_set_mode(ssl_, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
@@ -55,10 +285,18 @@ engine::engine(SSL_CTX* context)
   ::BIO* int_bio = 0;
   ::BIO_new_bio_pair(&int_bio, 0, &ext_bio_, 0);
   ::SSL_set_bio(ssl_, int_bio, int_bio);
+
+#if defined(ASIO_HAS_SSL_KERNEL_TLS)
+  ::SSL_set_ex_data(ssl_, ex_data_index(), this);
+#endif // defined(ASIO_HAS_SSL_KERNEL_TLS)
 }
 
 engine::~engine()
 {
+#if defined(ASIO_HAS_SSL_KERNEL_TLS)
+  ::OPENSSL_cleanse(send_secret_, sizeof(send_secret_));
+#endif // defined(ASIO_HAS_SSL_KERNEL_TLS)
+
   if (SSL_get_app_data(ssl_))
   {
     delete static_cast<verify_callback_base*>(SSL_get_app_data(ssl_));
@@ -133,6 +371,20 @@ int engine::verify_callback_function(int preverified, X509_STORE_CTX* ctx)
 engine::want engine::handshake(
     stream_base::handshake_type type, asio::error_code& ec)
 {
+#if defined(ASIO_HAS_SSL_KERNEL_TLS)
+  // The records are counted for set_kernel_send(), which only servers of
+  // contexts that enable it use, so that other streams keep any message
+  // callback of their context and pay nothing for it.
+  if (type == asio::ssl::stream_base::server
+      && ::SSL_CTX_get_keylog_callback(::SSL_get_SSL_CTX(ssl_))
+        == &engine::keylog_callback_function)
+  {
+    ::SSL_set_msg_callback(ssl_, &engine::message_callback_function);
+    ::SSL_set_msg_callback_arg(ssl_, this);
+    records_counted_ = true;
+  }
+#endif // defined(ASIO_HAS_SSL_KERNEL_TLS)
+
   return perform((type == asio::ssl::stream_base::client)
       ? &engine::do_connect : &engine::do_accept, 0, 0, ec, 0);
 }
@@ -151,9 +403,24 @@ engine::want engine::write(const asio::const_buffer& data,
     return engine::want_nothing;
   }
 
+  // With partial writes enabled, each write makes a single record, so a small
+  // record is made by writing no more than it holds. The maximum fragment
+  // length of the SSL is left alone, as its write buffer does not grow back
+  // once it has been released and allocated again for smaller records.
+  std::size_t length = asio::buffer_size(data);
+  if (small_record_bytes_ != 0)
+  {
+    // The most an AEAD cipher adds to the data of a record: the header, an
+    // explicit nonce (TLS 1.2) or the inner content type (TLS 1.3), and the
+    // tag.
+    const std::size_t record_overhead = 5 + 8 + 16;
+    if (length > small_record_size - record_overhead)
+      length = small_record_size - record_overhead;
+  }
+
   return perform(&engine::do_write,
       const_cast<void*>(asio::buffer_cast<const void*>(data)),
-      asio::buffer_size(data), ec, &bytes_transferred);
+      length, ec, &bytes_transferred);
 }
 
 engine::want engine::read(const asio::mutable_buffer& data,
@@ -192,6 +459,14 @@ asio::const_buffer engine::put_input(
       (length > 0 ? static_cast<std::size_t>(length) : 0));
 }
 
+// The reason a stream that ends without a proper shutdown fails with.
+// OpenSSL 1.1 dropped SSL_R_SHORT_READ; the code keeps its old value.
+#if defined(SSL_R_SHORT_READ)
+# define ASIO_SSL_R_SHORT_READ SSL_R_SHORT_READ
+#else // defined(SSL_R_SHORT_READ)
+# define ASIO_SSL_R_SHORT_READ 219
+#endif // defined(SSL_R_SHORT_READ)
+
 const asio::error_code& engine::map_error_code(
     asio::error_code& ec) const
 {
@@ -203,32 +478,156 @@ const asio::error_code& engine::map_error_code(
   if (BIO_wpending(ext_bio_))
   {
     ec = asio::error_code(
-        ERR_PACK(ERR_LIB_SSL, 0, SSL_R_SHORT_READ),
+        ERR_PACK(ERR_LIB_SSL, 0, ASIO_SSL_R_SHORT_READ),
         asio::error::get_ssl_category());
     return ec;
   }
 
+#if (OPENSSL_VERSION_NUMBER < 0x10100000L)
   // SSL v2 doesn't provide a protocol-level shutdown, so an eof on the
   // underlying transport is passed through.
   if (ssl_->version == SSL2_VERSION)
     return ec;
+#endif // (OPENSSL_VERSION_NUMBER < 0x10100000L)
 
   // Otherwise, the peer should have negotiated a proper shutdown.
   if ((::SSL_get_shutdown(ssl_) & SSL_RECEIVED_SHUTDOWN) == 0)
   {
     ec = asio::error_code(
-        ERR_PACK(ERR_LIB_SSL, 0, SSL_R_SHORT_READ),
+        ERR_PACK(ERR_LIB_SSL, 0, ASIO_SSL_R_SHORT_READ),
         asio::error::get_ssl_category());
   }
 
   return ec;
 }
 
+void engine::set_dynamic_record_sizing(std::size_t small_bytes)
+{
+  small_record_bytes_ = small_bytes;
+}
+
+asio::error_code engine::set_kernel_send(
+    int descriptor, asio::error_code& ec)
+{
+#if defined(ASIO_HAS_SSL_KERNEL_TLS)
+  // Only the server side is supported: a client's TLS 1.3 secret is logged
+  // before its last handshake record is sent, which would be miscounted.
+  // Whatever the engine has written must be on its way, and the kernel's
+  // sequence numbers carry on from it. Failing, the secret is not kept any
+  // longer than it has to be.
+  kernel_tls::crypto_info info;
+  std::size_t size = 0;
+  if (!kernel_send_ && records_counted_ && ::SSL_is_init_finished(ssl_)
+      && ::SSL_is_server(ssl_) && ::BIO_ctrl_pending(ext_bio_) == 0)
+    size = kernel_tls::make_crypto_info(ssl_, send_secret_,
+        send_secret_length_, records_sent_, info);
+
+  // Without the tls module the ULP cannot be attached. With it attached
+  // but no keys given, the socket goes on sending as it did.
+  static const char ulp[] = "tls";
+  if (size == 0 || ::setsockopt(descriptor, SOL_TCP, TCP_ULP,
+        ulp, sizeof(ulp)) != 0)
+  {
+    ::OPENSSL_cleanse(&info, sizeof(info));
+    ::OPENSSL_cleanse(send_secret_, sizeof(send_secret_));
+    send_secret_length_ = 0;
+    ec = asio::error::operation_not_supported;
+    return ec;
+  }
+
+  int result = ::setsockopt(descriptor, SOL_TLS, TLS_TX,
+      &info, static_cast<socklen_t>(size));
+  ::OPENSSL_cleanse(&info, sizeof(info));
+  if (result != 0)
+  {
+    ::OPENSSL_cleanse(send_secret_, sizeof(send_secret_));
+    send_secret_length_ = 0;
+    ec = asio::error::operation_not_supported;
+    return ec;
+  }
+
+  kernel_send_ = true;
+  ::OPENSSL_cleanse(send_secret_, sizeof(send_secret_));
+  send_secret_length_ = 0;
+  ec = asio::error_code();
+  return ec;
+#else // defined(ASIO_HAS_SSL_KERNEL_TLS)
+  (void)descriptor;
+  ec = asio::error::operation_not_supported;
+  return ec;
+#endif // defined(ASIO_HAS_SSL_KERNEL_TLS)
+}
+
+#if defined(ASIO_HAS_SSL_KERNEL_TLS)
+int engine::ex_data_index()
+{
+  static int index = ::SSL_get_ex_new_index(0, 0, 0, 0, 0);
+  return index;
+}
+
+void engine::keylog_callback_function(const SSL* ssl, const char* line)
+{
+  engine* e = static_cast<engine*>(::SSL_get_ex_data(ssl, ex_data_index()));
+  if (!e)
+    return;
+
+  // "<label> <client random> <secret>", both in hex. The secret of the
+  // application traffic is logged as the key it makes comes into use.
+  const char* label = ::SSL_is_server(ssl)
+    ? "SERVER_TRAFFIC_SECRET_0 " : "CLIENT_TRAFFIC_SECRET_0 ";
+  std::size_t label_length = std::strlen(label);
+  if (std::strncmp(line, label, label_length) != 0)
+    return;
+  const char* secret = std::strchr(line + label_length, ' ');
+  if (!secret)
+    return;
+  ++secret;
+
+  std::size_t length = std::strlen(secret) / 2;
+  if (length > sizeof(e->send_secret_))
+    return;
+  for (std::size_t i = 0; i < 2 * length; ++i)
+  {
+    char c = secret[i];
+    int digit = (c >= '0' && c <= '9') ? c - '0'
+      : (c >= 'a' && c <= 'f') ? c - 'a' + 10
+      : (c >= 'A' && c <= 'F') ? c - 'A' + 10 : -1;
+    if (digit < 0)
+      return;
+    if (i % 2 == 0)
+      e->send_secret_[i / 2] = static_cast<unsigned char>(digit << 4);
+    else
+      e->send_secret_[i / 2] |= static_cast<unsigned char>(digit);
+  }
+  e->send_secret_length_ = length;
+  e->records_sent_ = 0;
+}
+
+void engine::message_callback_function(int write_p, int,
+    int content_type, const void*, std::size_t, SSL* ssl, void* arg)
+{
+  engine* e = static_cast<engine*>(arg);
+  if (!write_p || !e)
+    return;
+
+  // In TLS 1.2 the key changes with the ChangeCipherSpec sent, whose own
+  // record header has been reported by then. TLS 1.3 sends one only for
+  // middleboxes, well before its key changes with the secret logged.
+  if (content_type == SSL3_RT_HEADER)
+    ++e->records_sent_;
+  else if (content_type == SSL3_RT_CHANGE_CIPHER_SPEC
+      && ::SSL_version(ssl) != TLS1_3_VERSION)
+    e->records_sent_ = 0;
+}
+#endif // defined(ASIO_HAS_SSL_KERNEL_TLS)
+
+#if (OPENSSL_VERSION_NUMBER < 0x10100000L)
 asio::detail::static_mutex& engine::accept_mutex()
 {
   static asio::detail::static_mutex mutex = ASIO_STATIC_MUTEX_INIT;
   return mutex;
 }
+#endif // (OPENSSL_VERSION_NUMBER < 0x10100000L)
 
 engine::want engine::perform(int (engine::* op)(void*, std::size_t),
     void* data, std::size_t length, asio::error_code& ec,
@@ -241,6 +640,14 @@ engine::want engine::perform(int (engine::* op)(void*, std::size_t),
   int sys_error = static_cast<int>(::ERR_get_error());
   std::size_t pending_output_after = ::BIO_ctrl_pending(ext_bio_);
 
+  // Once the kernel encrypts what is sent, a record written here, such as a
+  // response to a key update, would break the sequence of records.
+  if (kernel_send_ && pending_output_after > pending_output_before)
+  {
+    ec = asio::error::operation_not_supported;
+    return want_nothing;
+  }
+
   if (ssl_error == SSL_ERROR_SSL)
   {
     ec = asio::error_code(sys_error,
@@ -287,7 +694,11 @@ engine::want engine::perform(int (engine::* op)(void*, std::size_t),
 
 int engine::do_accept(void*, std::size_t)
 {
+  // OpenSSL 1.1.0 made its own state thread safe, so that handshakes run in
+  // parallel on the threads of a handshake pool.
+#if (OPENSSL_VERSION_NUMBER < 0x10100000L)
   asio::detail::static_mutex::scoped_lock lock(accept_mutex());
+#endif // (OPENSSL_VERSION_NUMBER < 0x10100000L)
   return ::SSL_accept(ssl_);
 }
 
@@ -312,8 +723,19 @@ int engine::do_read(void* data, std::size_t length)
 
 int engine::do_write(void* data, std::size_t length)
 {
-  return ::SSL_write(ssl_, data,
+  int result = ::SSL_write(ssl_, data,
       length < INT_MAX ? static_cast<int>(length) : INT_MAX);
+
+  // Once the bytes meant for small records are out, the records grow to the
+  // maximum size.
+  if (result > 0 && small_record_bytes_ != 0)
+  {
+    std::size_t written = static_cast<std::size_t>(result);
+    small_record_bytes_ -= written < small_record_bytes_
+      ? written : small_record_bytes_;
+  }
+
+  return result;
 }
 
 #endif // !defined(ASIO_ENABLE_OLD_SSL)
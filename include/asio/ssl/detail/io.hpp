@@ -18,6 +18,8 @@
 #include "asio/detail/config.hpp"
 
 #if !defined(ASIO_ENABLE_OLD_SSL)
+# include "asio/detail/bind_handler.hpp"
+# include "asio/io_service.hpp"
 # include "asio/ssl/detail/engine.hpp"
 # include "asio/ssl/detail/stream_core.hpp"
 # include "asio/write.hpp"
@@ -31,6 +33,28 @@ namespace detail {
 
 #if !defined(ASIO_ENABLE_OLD_SSL)
 
+class handshake_op;
+template <typename ConstBufferSequence> class buffered_handshake_op;
+
+// Whether the steps of an operation may be run on a handshake_pool.
+template <typename Operation>
+struct is_handshake_op
+{
+  enum { value = 0 };
+};
+
+template <>
+struct is_handshake_op<handshake_op>
+{
+  enum { value = 1 };
+};
+
+template <typename ConstBufferSequence>
+struct is_handshake_op<buffered_handshake_op<ConstBufferSequence> >
+{
+  enum { value = 1 };
+};
+
 template <typename Stream, typename Operation>
 std::size_t io(Stream& next_layer, stream_core& core,
     const Operation& op, asio::error_code& ec)
@@ -43,11 +67,13 @@ std::size_t io(Stream& next_layer, stream_core& core,
     // If the input buffer is empty then we need to read some more data from
     // the underlying transport.
     if (asio::buffer_size(core.input_) == 0)
-      core.input_ = asio::buffer(core.input_buffer_,
-          next_layer.read_some(core.input_buffer_, ec));
+      core.input_ = asio::buffer(core.input_buffer(),
+          next_layer.read_some(core.input_buffer(), ec));
 
-    // Pass the new input data to the engine.
+    // Pass the new input data to the engine, returning the buffer once the
+    // engine has all of it.
     core.input_ = core.engine_.put_input(core.input_);
+    core.release_input_buffer();
 
     // Try the operation again.
     continue;
@@ -57,7 +83,8 @@ std::size_t io(Stream& next_layer, stream_core& core,
     // Get output data from the engine and write it to the underlying
     // transport.
     asio::write(next_layer,
-        core.engine_.get_output(core.output_buffer_), ec);
+        core.engine_.get_output(core.output_buffer()), ec);
+    core.release_output_buffer();
 
     // Try the operation again.
     continue;
@@ -67,7 +94,8 @@ std::size_t io(Stream& next_layer, stream_core& core,
     // Get output data from the engine and write it to the underlying
     // transport.
     asio::write(next_layer,
-        core.engine_.get_output(core.output_buffer_), ec);
+        core.engine_.get_output(core.output_buffer()), ec);
+    core.release_output_buffer();
 
     // Operation is complete. Return result to caller.
     core.engine_.map_error_code(ec);
@@ -131,12 +159,31 @@ public:
   void operator()(asio::error_code ec,
       std::size_t bytes_transferred = ~std::size_t(0), int start = 0)
   {
+    // Waiters on the pending_read_ and pending_write_ timers are woken with
+    // no bytes transferred. The buffers belong to whichever operation is
+    // actually reading or writing.
+    const bool timer = (bytes_transferred == ~std::size_t(0));
+
     switch (start_ = start)
     {
     case 1: // Called after at least one async operation.
       do
       {
-        switch (want_ = op_(core_.engine_, ec_, bytes_transferred_))
+        // Hand the step to the handshake pool, if the stream has one. The
+        // pool runs it and then resumes the operation at "case 2:" below.
+        if (is_handshake_op<Operation>::value && core_.handshake_pool_)
+        {
+          core_.handshake_pool_->get_io_service().post(
+              pooled_step(ASIO_MOVE_CAST(io_op)(*this)));
+          return;
+        }
+
+        want_ = op_(core_.engine_, ec_, bytes_transferred_);
+
+        // Fall through.
+
+      case 2: // Resumed after a step run on the handshake pool.
+        switch (want_)
         {
         case engine::want_input_and_retry:
 
@@ -145,6 +192,7 @@ public:
           if (asio::buffer_size(core_.input_) != 0)
           {
             core_.input_ = core_.engine_.put_input(core_.input_);
+            core_.release_input_buffer();
             continue;
           }
 
@@ -157,9 +205,9 @@ public:
             // Prevent other read operations from being started.
             core_.pending_read_.expires_at(core_.pos_infin());
 
-            // Start reading some data from the underlying transport.
-            next_layer_.async_read_some(
-                asio::buffer(core_.input_buffer_),
+            // Wait for data to arrive before borrowing a buffer to read it
+            // into, so that a stream waiting for its peer holds none.
+            next_layer_.async_read_some(asio::null_buffers(),
                 ASIO_MOVE_CAST(io_op)(*this));
           }
           else
@@ -186,7 +234,7 @@ public:
 
             // Start writing all the data to the underlying transport.
             asio::async_write(next_layer_,
-                core_.engine_.get_output(core_.output_buffer_),
+                core_.engine_.get_output(core_.output_buffer()),
                 ASIO_MOVE_CAST(io_op)(*this));
           }
           else
@@ -206,10 +254,10 @@ public:
           // the async operation's initiating function. In this case we're not
           // allowed to call the handler directly. Instead, issue a zero-sized
           // read so the handler runs "as-if" posted using io_service::post().
-          if (start)
+          if (start == 1)
           {
             next_layer_.async_read_some(
-                asio::buffer(core_.input_buffer_, 0),
+                asio::mutable_buffers_1(0, 0),
                 ASIO_MOVE_CAST(io_op)(*this));
 
             // Yield control until asynchronous operation completes. Control
@@ -223,8 +271,10 @@ public:
           }
         }
 
+        // Fall through.
+
         default:
-        if (bytes_transferred == ~std::size_t(0))
+        if (timer)
           bytes_transferred = 0; // Timer cancellation, no data transferred.
         else if (!ec_)
           ec_ = ec;
@@ -233,10 +283,25 @@ public:
         {
         case engine::want_input_and_retry:
 
-          // Add received data to the engine's input.
-          core_.input_ = asio::buffer(
-              core_.input_buffer_, bytes_transferred);
-          core_.input_ = core_.engine_.put_input(core_.input_);
+          // Data has arrived, as a read completes with some or fails. Read
+          // it into a borrowed buffer.
+          if (!timer && bytes_transferred == 0 && !ec)
+          {
+            next_layer_.async_read_some(core_.input_buffer(),
+                ASIO_MOVE_CAST(io_op)(*this));
+            return;
+          }
+
+          // Add received data to the engine's input, returning the buffer
+          // once the engine has all of it.
+          if (bytes_transferred != 0)
+          {
+            core_.input_ = asio::buffer(
+                core_.input_buffer(), bytes_transferred);
+            core_.input_ = core_.engine_.put_input(core_.input_);
+          }
+          if (!timer)
+            core_.release_input_buffer();
 
           // Release any waiting read operations.
           core_.pending_read_.expires_at(core_.neg_infin());
@@ -246,6 +311,10 @@ public:
 
         case engine::want_output_and_retry:
 
+          // Return the buffer the write was made from.
+          if (!timer)
+            core_.release_output_buffer();
+
           // Release any waiting write operations.
           core_.pending_write_.expires_at(core_.neg_infin());
 
@@ -254,10 +323,14 @@ public:
 
         case engine::want_output:
 
+          // Return the buffer the write was made from.
+          if (!timer)
+            core_.release_output_buffer();
+
           // Release any waiting write operations.
           core_.pending_write_.expires_at(core_.neg_infin());
 
-          // Fall through to call handler.
+          // Fall through - to call handler.
 
         default:
 
@@ -276,6 +349,30 @@ public:
     }
   }
 
+  // Runs a step of the operation on the handshake pool, and then posts the
+  // operation back, to be resumed through the handler's invocation hook.
+  // The work keeps the stream's io_service running meanwhile.
+  struct pooled_step
+  {
+    explicit pooled_step(ASIO_MOVE_ARG(io_op) op)
+      : op_(ASIO_MOVE_CAST(io_op)(op)),
+        work_(op_.next_layer_.lowest_layer().get_io_service())
+    {
+    }
+
+    void operator()()
+    {
+      op_.want_ = op_.op_(op_.core_.engine_,
+          op_.ec_, op_.bytes_transferred_);
+      work_.get_io_service().post(
+          asio::detail::bind_handler(ASIO_MOVE_CAST(io_op)(op_),
+            asio::error_code(), std::size_t(0), 2));
+    }
+
+    io_op op_;
+    asio::io_service::work work_;
+  };
+
 //private:
   Stream& next_layer_;
   stream_core& core_;
@@ -0,0 +1,186 @@
+//
+// ssl/detail/record_buffer_pool.hpp
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2003-2015 Christopher M. Kohlhoff (chris at kohlhoff dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef ASIO_SSL_DETAIL_RECORD_BUFFER_POOL_HPP
+#define ASIO_SSL_DETAIL_RECORD_BUFFER_POOL_HPP
+
+#if defined(_MSC_VER) && (_MSC_VER >= 1200)
+# pragma once
+#endif // defined(_MSC_VER) && (_MSC_VER >= 1200)
+
+#include "asio/detail/config.hpp"
+
+#if !defined(ASIO_ENABLE_OLD_SSL)
+# include <cstddef>
+# include <vector>
+# include "asio/detail/atomic_count.hpp"
+# include "asio/detail/mutex.hpp"
+# include "asio/detail/noncopyable.hpp"
+#endif // !defined(ASIO_ENABLE_OLD_SSL)
+
+#include "asio/detail/push_options.hpp"
+
+namespace asio {
+namespace ssl {
+namespace detail {
+
+#if !defined(ASIO_ENABLE_OLD_SSL)
+
+// Buffers large enough for a TLS record, shared by all streams. A stream
+// borrows one only for as long as a read from or a write to the transport is
+// in progress, so that streams waiting for their peer hold none. Returned
+// buffers are kept for reuse: up to max_cached of them by the thread that
+// returned them, which takes no lock to get them back, and up to max_pooled
+// more in a list shared by all threads. A thread's buffers go to the shared
+// list when it exits.
+class record_buffer_pool
+  : private noncopyable
+{
+public:
+  // According to the OpenSSL documentation, this is the buffer size that is
+  // sufficient to hold the largest possible TLS record.
+  enum { buffer_size = 17 * 1024 };
+
+  enum { max_pooled = 256 };
+
+  // A read and a write in progress on each of a few streams.
+  enum { max_cached = 16 };
+
+  // The pool of the process. It is never destroyed, as streams may still
+  // return buffers while static objects are destroyed.
+  static record_buffer_pool& instance()
+  {
+    static record_buffer_pool* pool = new record_buffer_pool;
+    return *pool;
+  }
+
+  unsigned char* acquire()
+  {
+    ++in_use_;
+#if defined(ASIO_HAS_THREAD_LOCAL)
+    thread_cache& cache = local_cache();
+    if (cache.count > 0)
+    {
+      --pooled_;
+      return cache.buffers[--cache.count];
+    }
+#endif // defined(ASIO_HAS_THREAD_LOCAL)
+
+    {
+      asio::detail::mutex::scoped_lock lock(mutex_);
+      if (!free_.empty())
+      {
+        unsigned char* buffer = free_.back();
+        free_.pop_back();
+        --pooled_;
+        return buffer;
+      }
+    }
+
+    return new unsigned char[buffer_size];
+  }
+
+  void release(unsigned char* buffer)
+  {
+    --in_use_;
+#if defined(ASIO_HAS_THREAD_LOCAL)
+    thread_cache& cache = local_cache();
+    if (cache.count < max_cached)
+    {
+      cache.buffers[cache.count++] = buffer;
+      ++pooled_;
+      return;
+    }
+#endif // defined(ASIO_HAS_THREAD_LOCAL)
+
+    share(buffer);
+  }
+
+  // The number of buffers lent out. Approximate while buffers change hands.
+  std::size_t in_use() const
+  {
+    return static_cast<std::size_t>(in_use_);
+  }
+
+  // The number of buffers kept for reuse, by all threads. Approximate while
+  // buffers change hands.
+  std::size_t pooled() const
+  {
+    return static_cast<std::size_t>(pooled_);
+  }
+
+private:
+#if defined(ASIO_HAS_THREAD_LOCAL)
+  struct thread_cache
+  {
+    thread_cache()
+      : count(0)
+    {
+    }
+
+    ~thread_cache()
+    {
+      record_buffer_pool& pool = instance();
+      while (count > 0)
+      {
+        --pool.pooled_;
+        pool.share(buffers[--count]);
+      }
+    }
+
+    unsigned char* buffers[max_cached];
+    std::size_t count;
+  };
+
+  static thread_cache& local_cache()
+  {
+    static thread_local thread_cache cache;
+    return cache;
+  }
+#endif // defined(ASIO_HAS_THREAD_LOCAL)
+
+  record_buffer_pool()
+    : in_use_(0),
+      pooled_(0)
+  {
+    free_.reserve(max_pooled);
+  }
+
+  // Keeps a returned buffer in the shared list, or frees it if that is full.
+  void share(unsigned char* buffer)
+  {
+    {
+      asio::detail::mutex::scoped_lock lock(mutex_);
+      if (free_.size() < max_pooled)
+      {
+        free_.push_back(buffer);
+        ++pooled_;
+        return;
+      }
+    }
+
+    delete[] buffer;
+  }
+
+  asio::detail::mutex mutex_;
+  std::vector<unsigned char*> free_;
+  asio::detail::atomic_count in_use_;
+  asio::detail::atomic_count pooled_;
+};
+
+#endif // !defined(ASIO_ENABLE_OLD_SSL)
+
+} // namespace detail
+} // namespace ssl
+} // namespace asio
+
+#include "asio/detail/pop_options.hpp"
+
+#endif // ASIO_SSL_DETAIL_RECORD_BUFFER_POOL_HPP
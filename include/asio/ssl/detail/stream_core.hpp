@@ -24,6 +24,8 @@
 #  include "asio/steady_timer.hpp"
 # endif // defined(ASIO_HAS_BOOST_DATE_TIME)
 # include "asio/ssl/detail/engine.hpp"
+# include "asio/ssl/detail/record_buffer_pool.hpp"
+# include "asio/ssl/handshake_pool.hpp"
 # include "asio/buffer.hpp"
 #endif // !defined(ASIO_ENABLE_OLD_SSL)
 
@@ -39,16 +41,15 @@ struct stream_core
 {
   // According to the OpenSSL documentation, this is the buffer size that is
   // sufficient to hold the largest possible TLS record.
-  enum { max_tls_record_size = 17 * 1024 };
+  enum { max_tls_record_size = record_buffer_pool::buffer_size };
 
   stream_core(SSL_CTX* context, asio::io_service& io_service)
     : engine_(context),
       pending_read_(io_service),
       pending_write_(io_service),
-      output_buffer_space_(max_tls_record_size),
-      output_buffer_(asio::buffer(output_buffer_space_)),
-      input_buffer_space_(max_tls_record_size),
-      input_buffer_(asio::buffer(input_buffer_space_))
+      output_buffer_space_(0),
+      input_buffer_space_(0),
+      handshake_pool_(0)
   {
     pending_read_.expires_at(neg_infin());
     pending_write_.expires_at(neg_infin());
@@ -56,6 +57,49 @@ struct stream_core
 
   ~stream_core()
   {
+    if (output_buffer_space_)
+      record_buffer_pool::instance().release(output_buffer_space_);
+    if (input_buffer_space_)
+      record_buffer_pool::instance().release(input_buffer_space_);
+  }
+
+  // A buffer that may be used to prepare output intended for the transport,
+  // borrowed from the pool until release_output_buffer is called.
+  asio::mutable_buffers_1 output_buffer()
+  {
+    if (!output_buffer_space_)
+      output_buffer_space_ = record_buffer_pool::instance().acquire();
+    return asio::buffer(output_buffer_space_, max_tls_record_size);
+  }
+
+  // Returns the output buffer once the output is written.
+  void release_output_buffer()
+  {
+    if (output_buffer_space_)
+    {
+      record_buffer_pool::instance().release(output_buffer_space_);
+      output_buffer_space_ = 0;
+    }
+  }
+
+  // A buffer that may be used to read input intended for the engine,
+  // borrowed from the pool until release_input_buffer is called.
+  asio::mutable_buffers_1 input_buffer()
+  {
+    if (!input_buffer_space_)
+      input_buffer_space_ = record_buffer_pool::instance().acquire();
+    return asio::buffer(input_buffer_space_, max_tls_record_size);
+  }
+
+  // Returns the input buffer, unless it still holds input the engine has not
+  // taken yet.
+  void release_input_buffer()
+  {
+    if (input_buffer_space_ && asio::buffer_size(input_) == 0)
+    {
+      record_buffer_pool::instance().release(input_buffer_space_);
+      input_buffer_space_ = 0;
+    }
   }
 
   // The SSL engine.
@@ -99,17 +143,15 @@ struct stream_core
   }
 #endif // defined(ASIO_HAS_BOOST_DATE_TIME)
 
-  // Buffer space used to prepare output intended for the transport.
-  std::vector<unsigned char> output_buffer_space_;
-
-  // A buffer that may be used to prepare output intended for the transport.
-  const asio::mutable_buffers_1 output_buffer_;
+  // Buffer space used to prepare output intended for the transport, while
+  // borrowed.
+  unsigned char* output_buffer_space_;
 
-  // Buffer space used to read input intended for the engine.
-  std::vector<unsigned char> input_buffer_space_;
+  // Buffer space used to read input intended for the engine, while borrowed.
+  unsigned char* input_buffer_space_;
 
-  // A buffer that may be used to read input intended for the engine.
-  const asio::mutable_buffers_1 input_buffer_;
+  // The pool on which handshake steps are run, if any.
+  handshake_pool* handshake_pool_;
 
   // The buffer pointing to the engine's unconsumed input.
   asio::const_buffer input_;
@@ -18,6 +18,7 @@
 #include "asio/detail/config.hpp"
 
 #if !defined(ASIO_ENABLE_OLD_SSL)
+# include "asio/buffer.hpp"
 # include "asio/detail/buffer_sequence_adapter.hpp"
 # include "asio/ssl/detail/engine.hpp"
 #endif // !defined(ASIO_ENABLE_OLD_SSL)
@@ -47,6 +48,19 @@ public:
       asio::detail::buffer_sequence_adapter<asio::const_buffer,
         ConstBufferSequence>::first(buffers_);
 
+    // Each write becomes at least one record, so a first buffer shorter than
+    // a record, such as the head of a response, is gathered with the buffers
+    // after it into a record of their own. Should the write have to be
+    // retried, the same bytes are gathered again, which the engine accepts
+    // from a different address.
+    std::size_t length = asio::buffer_size(buffer);
+    if (length < max_record_size && asio::buffer_size(buffers_) > length)
+    {
+      unsigned char gathered[max_record_size];
+      length = asio::buffer_copy(asio::buffer(gathered), buffers_);
+      return eng.write(asio::buffer(gathered, length), ec, bytes_transferred);
+    }
+
     return eng.write(buffer, ec, bytes_transferred);
   }
 
@@ -59,6 +73,9 @@ public:
   }
 
 private:
+  // The most data a TLS record holds.
+  enum { max_record_size = 16 * 1024 };
+
   ConstBufferSequence buffers_;
 };
 
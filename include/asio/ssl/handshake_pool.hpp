@@ -0,0 +1,111 @@
+//
+// ssl/handshake_pool.hpp
+// ~~~~~~~~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2003-2015 Christopher M. Kohlhoff (chris at kohlhoff dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef ASIO_SSL_HANDSHAKE_POOL_HPP
+#define ASIO_SSL_HANDSHAKE_POOL_HPP
+
+#if defined(_MSC_VER) && (_MSC_VER >= 1200)
+# pragma once
+#endif // defined(_MSC_VER) && (_MSC_VER >= 1200)
+
+#include "asio/detail/config.hpp"
+
+#if !defined(ASIO_ENABLE_OLD_SSL)
+# include <cstddef>
+# include <vector>
+# include "asio/detail/noncopyable.hpp"
+# include "asio/detail/scoped_ptr.hpp"
+# include "asio/detail/thread.hpp"
+# include "asio/io_service.hpp"
+#endif // !defined(ASIO_ENABLE_OLD_SSL)
+
+#include "asio/detail/push_options.hpp"
+
+namespace asio {
+namespace ssl {
+
+#if !defined(ASIO_ENABLE_OLD_SSL)
+
+/// A fixed set of threads on which streams run the steps of their handshakes.
+/**
+ * The steps of a handshake do the public key operations of the handshake,
+ * which take far longer than the reads and writes of established
+ * connections. A stream given a handshake_pool runs those steps on one of
+ * its threads, and continues the handshake through its handler once a step
+ * is done, so that the threads running the io_service are kept for I/O.
+ *
+ * @par Thread Safety
+ * @e Distinct @e objects: Safe.@n
+ * @e Shared @e objects: Safe.
+ *
+ * @note The pool must outlive every stream given it.
+ */
+class handshake_pool
+  : private noncopyable
+{
+public:
+  /// Construct a pool running handshake steps on the given number of threads.
+  explicit handshake_pool(std::size_t threads)
+    : work_(new asio::io_service::work(io_service_))
+  {
+    for (std::size_t i = 0; i < threads; ++i)
+      threads_.push_back(new asio::detail::thread(runner(io_service_)));
+  }
+
+  /// Destructor.
+  /**
+   * Runs the handshake steps already handed to the pool, and then waits for
+   * its threads to exit.
+   */
+  ~handshake_pool()
+  {
+    work_.reset();
+    for (std::size_t i = 0; i < threads_.size(); ++i)
+    {
+      threads_[i]->join();
+      delete threads_[i];
+    }
+  }
+
+  /// Get the io_service on which the handshake steps are run.
+  asio::io_service& get_io_service()
+  {
+    return io_service_;
+  }
+
+private:
+  struct runner
+  {
+    explicit runner(asio::io_service& io_service)
+      : io_service_(io_service)
+    {
+    }
+
+    void operator()()
+    {
+      io_service_.run();
+    }
+
+    asio::io_service& io_service_;
+  };
+
+  asio::io_service io_service_;
+  asio::detail::scoped_ptr<asio::io_service::work> work_;
+  std::vector<asio::detail::thread*> threads_;
+};
+
+#endif // !defined(ASIO_ENABLE_OLD_SSL)
+
+} // namespace ssl
+} // namespace asio
+
+#include "asio/detail/pop_options.hpp"
+
+#endif // ASIO_SSL_HANDSHAKE_POOL_HPP
@@ -23,6 +23,7 @@
 # include "asio/detail/throw_error.hpp"
 # include "asio/error.hpp"
 # include "asio/ssl/context.hpp"
+# include "asio/ssl/detail/engine.hpp"
 # include "asio/ssl/error.hpp"
 #endif // !defined(ASIO_ENABLE_OLD_SSL)
 
@@ -70,7 +71,7 @@ context::context(context::method m)
 
   switch (m)
   {
-#if defined(OPENSSL_NO_SSL2)
+#if defined(OPENSSL_NO_SSL2) || (OPENSSL_VERSION_NUMBER >= 0x10100000L)
   case context::sslv2:
   case context::sslv2_client:
   case context::sslv2_server:
@@ -87,7 +88,15 @@ context::context(context::method m)
   case context::sslv2_server:
     handle_ = ::SSL_CTX_new(::SSLv2_server_method());
     break;
-#endif // defined(OPENSSL_NO_SSL2)
+#endif // defined(OPENSSL_NO_SSL2) || (OPENSSL_VERSION_NUMBER >= 0x10100000L)
+#if defined(OPENSSL_NO_SSL3) || defined(OPENSSL_NO_SSL3_METHOD)
+  case context::sslv3:
+  case context::sslv3_client:
+  case context::sslv3_server:
+    asio::detail::throw_error(
+        asio::error::invalid_argument, "context");
+    break;
+#else // defined(OPENSSL_NO_SSL3) || defined(OPENSSL_NO_SSL3_METHOD)
   case context::sslv3:
     handle_ = ::SSL_CTX_new(::SSLv3_method());
     break;
@@ -97,6 +106,38 @@ context::context(context::method m)
   case context::sslv3_server:
     handle_ = ::SSL_CTX_new(::SSLv3_server_method());
     break;
+#endif // defined(OPENSSL_NO_SSL3) || defined(OPENSSL_NO_SSL3_METHOD)
+#if (OPENSSL_VERSION_NUMBER >= 0x10100000L)
+  // The version specific methods are deprecated; the generic ones are
+  // pinned to the version instead.
+  case context::tlsv1:
+  case context::tlsv1_client:
+  case context::tlsv1_server:
+    handle_ = ::SSL_CTX_new(::TLS_method());
+    set_protocol_version(TLS1_VERSION);
+    break;
+  case context::tlsv11:
+  case context::tlsv11_client:
+  case context::tlsv11_server:
+    handle_ = ::SSL_CTX_new(::TLS_method());
+    set_protocol_version(TLS1_1_VERSION);
+    break;
+  case context::tlsv12:
+  case context::tlsv12_client:
+  case context::tlsv12_server:
+    handle_ = ::SSL_CTX_new(::TLS_method());
+    set_protocol_version(TLS1_2_VERSION);
+    break;
+  case context::sslv23:
+    handle_ = ::SSL_CTX_new(::TLS_method());
+    break;
+  case context::sslv23_client:
+    handle_ = ::SSL_CTX_new(::TLS_client_method());
+    break;
+  case context::sslv23_server:
+    handle_ = ::SSL_CTX_new(::TLS_server_method());
+    break;
+#else // (OPENSSL_VERSION_NUMBER >= 0x10100000L)
   case context::tlsv1:
     handle_ = ::SSL_CTX_new(::TLSv1_method());
     break;
@@ -151,6 +192,7 @@ context::context(context::method m)
         asio::error::invalid_argument, "context");
     break;
 #endif // defined(SSL_TXT_TLSV1_2) 
+#endif // (OPENSSL_VERSION_NUMBER >= 0x10100000L)
   default:
     handle_ = ::SSL_CTX_new(0);
     break;
@@ -195,13 +237,12 @@ context::~context()
 {
   if (handle_)
   {
-    if (handle_->default_passwd_callback_userdata)
+    if (void* userdata = get_password_callback_userdata())
     {
       detail::password_callback_base* callback =
-        static_cast<detail::password_callback_base*>(
-            handle_->default_passwd_callback_userdata);
+        static_cast<detail::password_callback_base*>(userdata);
       delete callback;
-      handle_->default_passwd_callback_userdata = 0;
+      ::SSL_CTX_set_default_passwd_cb_userdata(handle_, 0);
     }
 
     if (SSL_CTX_get_app_data(handle_))
@@ -538,8 +579,8 @@ asio::error_code context::use_certificate_chain(
   {
     x509_cleanup cert = {
       ::PEM_read_bio_X509_AUX(bio.p, 0,
-          handle_->default_passwd_callback,
-          handle_->default_passwd_callback_userdata) };
+          get_password_callback(),
+          get_password_callback_userdata()) };
     if (!cert.p)
     {
       ec = asio::error_code(ERR_R_PEM_LIB,
@@ -556,15 +597,19 @@ asio::error_code context::use_certificate_chain(
       return ec;
     }
 
+#if (OPENSSL_VERSION_NUMBER >= 0x10002000L)
+    ::SSL_CTX_clear_chain_certs(handle_);
+#else // (OPENSSL_VERSION_NUMBER >= 0x10002000L)
     if (handle_->extra_certs)
     {
       ::sk_X509_pop_free(handle_->extra_certs, X509_free);
       handle_->extra_certs = 0;
     }
+#endif // (OPENSSL_VERSION_NUMBER >= 0x10002000L)
 
     while (X509* cacert = ::PEM_read_bio_X509(bio.p, 0,
-          handle_->default_passwd_callback,
-          handle_->default_passwd_callback_userdata))
+          get_password_callback(),
+          get_password_callback_userdata()))
     {
       if (!::SSL_CTX_add_extra_chain_cert(handle_, cacert))
       {
@@ -640,8 +685,8 @@ asio::error_code context::use_private_key(
       break;
     case context_base::pem:
       evp_private_key.p = ::PEM_read_bio_PrivateKey(
-          bio.p, 0, handle_->default_passwd_callback,
-          handle_->default_passwd_callback_userdata);
+          bio.p, 0, get_password_callback(),
+          get_password_callback_userdata());
       break;
     default:
       {
@@ -699,8 +744,8 @@ asio::error_code context::use_rsa_private_key(
       break;
     case context_base::pem:
       rsa_private_key.p = ::PEM_read_bio_RSAPrivateKey(
-          bio.p, 0, handle_->default_passwd_callback,
-          handle_->default_passwd_callback_userdata);
+          bio.p, 0, get_password_callback(),
+          get_password_callback_userdata());
       break;
     default:
       {
@@ -850,6 +895,16 @@ asio::error_code context::use_tmp_dh_file(
   return ec;
 }
 
+void context::enable_kernel_send()
+{
+#if defined(ASIO_HAS_SSL_KERNEL_TLS)
+  // The engine keeps the TLS 1.3 secrets it may hand to the kernel, and
+  // counts records only for contexts that have this callback.
+  ::SSL_CTX_set_keylog_callback(handle_,
+      &detail::engine::keylog_callback_function);
+#endif // defined(ASIO_HAS_SSL_KERNEL_TLS)
+}
+
 asio::error_code context::do_use_tmp_dh(
     BIO* bio, asio::error_code& ec)
 {
@@ -919,11 +974,10 @@ int context::verify_callback_function(int preverified, X509_STORE_CTX* ctx)
 asio::error_code context::do_set_password_callback(
     detail::password_callback_base* callback, asio::error_code& ec)
 {
-  if (handle_->default_passwd_callback_userdata)
-    delete static_cast<detail::password_callback_base*>(
-        handle_->default_passwd_callback_userdata);
+  if (void* userdata = get_password_callback_userdata())
+    delete static_cast<detail::password_callback_base*>(userdata);
 
-  handle_->default_passwd_callback_userdata = callback;
+  ::SSL_CTX_set_default_passwd_cb_userdata(handle_, callback);
 
   SSL_CTX_set_default_passwd_cb(handle_, &context::password_callback_function);
 
@@ -931,6 +985,35 @@ asio::error_code context::do_set_password_callback(
   return ec;
 }
 
+pem_password_cb* context::get_password_callback()
+{
+#if (OPENSSL_VERSION_NUMBER >= 0x10100000L)
+  return ::SSL_CTX_get_default_passwd_cb(handle_);
+#else // (OPENSSL_VERSION_NUMBER >= 0x10100000L)
+  return handle_->default_passwd_callback;
+#endif // (OPENSSL_VERSION_NUMBER >= 0x10100000L)
+}
+
+void* context::get_password_callback_userdata()
+{
+#if (OPENSSL_VERSION_NUMBER >= 0x10100000L)
+  return ::SSL_CTX_get_default_passwd_cb_userdata(handle_);
+#else // (OPENSSL_VERSION_NUMBER >= 0x10100000L)
+  return handle_->default_passwd_callback_userdata;
+#endif // (OPENSSL_VERSION_NUMBER >= 0x10100000L)
+}
+
+#if (OPENSSL_VERSION_NUMBER >= 0x10100000L)
+void context::set_protocol_version(int version)
+{
+  if (handle_)
+  {
+    ::SSL_CTX_set_min_proto_version(handle_, version);
+    ::SSL_CTX_set_max_proto_version(handle_, version);
+  }
+}
+#endif // (OPENSSL_VERSION_NUMBER >= 0x10100000L)
+
 int context::password_callback_function(
     char* buf, int size, int purpose, void* data)
 {
@@ -33,6 +33,7 @@
 # include "asio/ssl/detail/shutdown_op.hpp"
 # include "asio/ssl/detail/stream_core.hpp"
 # include "asio/ssl/detail/write_op.hpp"
+# include "asio/ssl/handshake_pool.hpp"
 # include "asio/ssl/stream_base.hpp"
 #endif // defined(ASIO_ENABLE_OLD_SSL)
 
@@ -347,6 +348,95 @@ public:
         new detail::verify_callback<VerifyCallback>(callback), ec);
   }
 
+  /// Hand the encryption of written records to the kernel.
+  /**
+   * This function may be used, once a server-side handshake is complete, to
+   * install the keys of the traffic sent into the kernel's TLS (Linux kTLS)
+   * on the lowest layer socket. From then on data written to the stream goes
+   * to the next layer as it is, and data may just as well be written to the
+   * socket directly, for example with @c sendfile. Reading still decrypts in
+   * the stream. The context must have had context::enable_kernel_send()
+   * called before the handshake.
+   *
+   * @throws asio::system_error Thrown on failure. The stream goes on
+   * encrypting what it writes itself, and discards the secret it kept for
+   * the kernel.
+   */
+  void set_kernel_send()
+  {
+    asio::error_code ec;
+    set_kernel_send(ec);
+    asio::detail::throw_error(ec, "set_kernel_send");
+  }
+
+  /// Hand the encryption of written records to the kernel.
+  /**
+   * This function may be used, once a server-side handshake is complete, to
+   * install the keys of the traffic sent into the kernel's TLS (Linux kTLS)
+   * on the lowest layer socket. From then on data written to the stream goes
+   * to the next layer as it is, and data may just as well be written to the
+   * socket directly, for example with @c sendfile. Reading still decrypts in
+   * the stream. The context must have had context::enable_kernel_send()
+   * called before the handshake.
+   *
+   * @param ec Set to asio::error::operation_not_supported if the context,
+   * the platform, the kernel, the protocol version or the cipher rule it out.
+   * The stream then goes on encrypting what it writes itself, and discards
+   * the secret it kept for the kernel.
+   */
+  asio::error_code set_kernel_send(asio::error_code& ec)
+  {
+    return core_.engine_.set_kernel_send(
+        static_cast<int>(next_layer_.lowest_layer().native_handle()), ec);
+  }
+
+  /// Determine whether the kernel encrypts the records written.
+  bool kernel_send() const
+  {
+    return core_.engine_.kernel_send();
+  }
+
+  /// Size the records written dynamically.
+  /**
+   * This function may be used, once the handshake is complete, to have the
+   * first data written go out in small records, each of which fits a single
+   * TCP segment. The peer can then decrypt and use the start of a response
+   * as soon as its first segments arrive, rather than waiting for a whole
+   * record of up to 16KB that may span a congestion window. Once the given
+   * number of bytes is written, the records grow to the maximum size, which
+   * costs the least framing and the fewest MAC computations.
+   *
+   * @param small_bytes The number of bytes to write in small records; 0
+   * writes records of the maximum size throughout.
+   *
+   * @note Has no effect on data written once set_kernel_send() succeeded, as
+   * the kernel then frames the records.
+   */
+  void set_dynamic_record_sizing(std::size_t small_bytes)
+  {
+    core_.engine_.set_dynamic_record_sizing(small_bytes);
+  }
+
+  /// Run the steps of asynchronous handshakes on a handshake pool.
+  /**
+   * This function may be used to have the key exchange and signing work of
+   * the stream's asynchronous handshakes done on the threads of a
+   * handshake_pool rather than the threads running the io_service. Each step
+   * of the handshake is run on the pool, and the handshake continues on the
+   * stream's io_service, through the handler, once it is done. Synchronous
+   * handshakes are not affected.
+   *
+   * @param pool The pool to use, which must outlive the stream, or null for
+   * the handshakes to run inline again.
+   *
+   * @note No other operation may be started on the stream while an
+   * asynchronous handshake is in progress.
+   */
+  void set_handshake_pool(handshake_pool* pool)
+  {
+    core_.handshake_pool_ = pool;
+  }
+
   /// Perform SSL handshaking.
   /**
    * This function is used to perform SSL handshaking on the stream. The
@@ -602,6 +692,9 @@ public:
   std::size_t write_some(const ConstBufferSequence& buffers,
       asio::error_code& ec)
   {
+    if (core_.engine_.kernel_send())
+      return next_layer_.write_some(buffers, ec);
+
     return detail::io(next_layer_, core_,
         detail::write_op<ConstBufferSequence>(buffers), ec);
   }
@@ -638,6 +731,10 @@ public:
     // not meet the documented type requirements for a WriteHandler.
     ASIO_WRITE_HANDLER_CHECK(WriteHandler, handler) type_check;
 
+    if (core_.engine_.kernel_send())
+      return next_layer_.async_write_some(buffers,
+          ASIO_MOVE_CAST(WriteHandler)(handler));
+
     asio::detail::async_result_init<
       WriteHandler, void (asio::error_code, std::size_t)> init(
         ASIO_MOVE_CAST(WriteHandler)(handler));
@@ -17,6 +17,11 @@
 
 #include "asio/detail/config.hpp"
 
+#if !defined(ASIO_ENABLE_OLD_SSL)
+# include <cstddef>
+# include "asio/ssl/detail/record_buffer_pool.hpp"
+#endif // !defined(ASIO_ENABLE_OLD_SSL)
+
 #include "asio/detail/push_options.hpp"
 
 namespace asio {
@@ -37,6 +42,27 @@ public:
     server
   };
 
+#if !defined(ASIO_ENABLE_OLD_SSL)
+  /// Get the number of bytes of record buffers lent to streams.
+  /**
+   * A stream borrows record buffers only while a read from or a write to the
+   * next layer is in progress, so this is the memory held by streams for
+   * that, across all of them.
+   */
+  static std::size_t buffer_bytes_in_use()
+  {
+    return detail::record_buffer_pool::instance().in_use()
+      * detail::record_buffer_pool::buffer_size;
+  }
+
+  /// Get the number of bytes of record buffers kept for reuse.
+  static std::size_t buffer_bytes_pooled()
+  {
+    return detail::record_buffer_pool::instance().pooled()
+      * detail::record_buffer_pool::buffer_size;
+  }
+#endif // !defined(ASIO_ENABLE_OLD_SSL)
+
 protected:
   /// Protected destructor to prevent deletion through this type.
   ~stream_base()
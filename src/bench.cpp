@@ -0,0 +1,443 @@
+#include <algorithm>
+#include <asio.hpp>
+#include <asio/ssl.hpp>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <getopt.h>
+#include <sys/stat.h>
+
+///////////////////////////////////////////////////////////////////////////////
+// bench -h <ip> -p <port> [-c <connections>] [-n <requests>]
+//       [-D <seconds>] [-t <threads>] [-k] [-u <path>]... [-S [-R]]
+// bench -g <directory>
+//
+// Load generator for final. It keeps a fixed number of connections busy,
+// either opening one per request (HTTP/1.0) or reusing them (-k, HTTP/1.1
+// keep-alive), and reports throughput and the latency distribution. With -S
+// it speaks HTTPS to final's TLS port, resuming the previous session of a
+// connection on each new one unless -R is given, and counts full and resumed
+// handshakes and the records the responses came in. With -g it writes a
+// fixture directory to serve instead.
+///////////////////////////////////////////////////////////////////////////////
+
+using namespace std;
+using asio::ip::tcp;
+typedef asio::ssl::stream<tcp::socket &> TlsStream;
+
+namespace Bench {
+
+// Files of the fixture directory, from a tiny page to a multi-megabyte asset.
+static const struct {
+  const char *path;
+  size_t size;
+} fixture[] = {
+    {"/index.html", 1024},
+    {"/small.txt", 4 * 1024},
+    {"/medium.bin", 256 * 1024},
+    {"/large.bin", 8 * 1024 * 1024},
+    {"/deep/a/b/c/d/e/page.html", 16 * 1024},
+};
+
+static bool writeFixture(string dir) {
+  for (const auto &file : fixture) {
+    string path = dir + file.path;
+    for (size_t p = 1; (p = path.find('/', p)) != string::npos; ++p)
+      mkdir(path.substr(0, p).c_str(), 0755);
+    ofstream os(path.c_str(), ios::out | ios::binary | ios::trunc);
+    for (size_t i = 0; i < file.size; ++i)
+      os.put(static_cast<char>('a' + i % 26));
+    if (!os)
+      return false;
+  }
+  return true;
+}
+
+// State shared by all connections of a run.
+struct Run {
+  tcp::endpoint endpoint;
+  vector<string> requests;
+  bool keepAlive = false;
+  unique_ptr<asio::ssl::context> tls; // Set for HTTPS.
+  bool resume = true;
+  atomic<long> remaining{0};
+  chrono::steady_clock::time_point deadline =
+      chrono::steady_clock::time_point::max();
+
+  atomic<long> completed{0};
+  atomic<long> errors{0};
+  atomic<long long> bytes{0};
+  atomic<long> fullHandshakes{0};
+  atomic<long> resumedHandshakes{0};
+  atomic<long> records{0};
+  atomic<long long> recordBytes{0}; // On the wire, headers included.
+  mutex mutex_;
+  vector<uint32_t> latencies; // Microseconds, merged from all connections.
+
+  // Claims the right to send one more request.
+  bool take() {
+    if (chrono::steady_clock::now() >= deadline)
+      return false;
+    return remaining.fetch_sub(1) > 0;
+  }
+};
+
+// Counts the records received once a handshake is done, from their headers.
+static void countRecord(int write, int, int contentType, const void *buf,
+                        size_t length, SSL *ssl, void *arg) {
+  if (write || contentType != SSL3_RT_HEADER || length < 5 ||
+      !SSL_is_init_finished(ssl))
+    return;
+  const unsigned char *header = static_cast<const unsigned char *>(buf);
+  Run &run = *static_cast<Run *>(arg);
+  ++run.records;
+  run.recordBytes += 5 + (header[3] << 8 | header[4]);
+}
+
+// One client connection issuing requests back to back.
+class Connection : public enable_shared_from_this<Connection> {
+public:
+  Connection(asio::io_service &service, Run &run, size_t first)
+      : socket_{service}, run_(run), next_{first} {}
+
+  ~Connection() {
+    if (session_)
+      SSL_SESSION_free(session_);
+    lock_guard<mutex> lock(run_.mutex_);
+    run_.latencies.insert(run_.latencies.end(), latencies_.begin(),
+                          latencies_.end());
+  }
+
+  void start() { next(); }
+
+private:
+  void next() {
+    if (!run_.take())
+      return;
+    request_ = &run_.requests[next_++ % run_.requests.size()];
+    start_ = chrono::steady_clock::now();
+    if (socket_.is_open()) {
+      send();
+      return;
+    }
+    auto self(shared_from_this());
+    socket_.async_connect(run_.endpoint, [this, self](asio::error_code error) {
+      if (error)
+        fail();
+      else if (run_.tls)
+        handshake();
+      else
+        send();
+    });
+  }
+
+  // A fresh TLS stream for every connection, offering the session of the
+  // previous one.
+  void handshake() {
+    // The request follows the client's last handshake message in a write of
+    // its own, which Nagle would hold back for an acknowledgement.
+    asio::error_code ignored_ec;
+    socket_.set_option(tcp::no_delay(true), ignored_ec);
+    tls_.reset(new TlsStream(socket_, *run_.tls));
+    if (session_ && run_.resume)
+      SSL_set_session(tls_->native_handle(), session_);
+    auto self(shared_from_this());
+    tls_->async_handshake(TlsStream::client,
+                          [this, self](asio::error_code error) {
+                            if (error) {
+                              fail();
+                              return;
+                            }
+                            if (SSL_session_reused(tls_->native_handle()))
+                              ++run_.resumedHandshakes;
+                            else
+                              ++run_.fullHandshakes;
+                            send();
+                          });
+  }
+
+  void send() {
+    auto self(shared_from_this());
+    auto handler = [this, self](asio::error_code error, size_t) {
+      if (error)
+        fail();
+      else
+        readHead();
+    };
+    if (tls_)
+      asio::async_write(*tls_, asio::buffer(*request_), handler);
+    else
+      asio::async_write(socket_, asio::buffer(*request_), handler);
+  }
+
+  void readHead() {
+    auto self(shared_from_this());
+    auto handler = [this, self](asio::error_code error, size_t length) {
+      if (error) {
+        fail();
+        return;
+      }
+      string head(asio::buffers_begin(buffer_.data()),
+                  asio::buffers_begin(buffer_.data()) + length);
+      buffer_.consume(length);
+      if (head.compare(0, 12, "HTTP/1.1 200") != 0 &&
+          head.compare(0, 12, "HTTP/1.0 200") != 0) {
+        fail();
+        return;
+      }
+      size_t p = head.find("Content-Length: ");
+      bodyLength_ = p == string::npos ? 0 : atol(head.c_str() + p + 16);
+      close_ = !run_.keepAlive ||
+               head.find("Connection: close") != string::npos;
+      readBody();
+    };
+    if (tls_)
+      asio::async_read_until(*tls_, buffer_, "\r\n\r\n", handler);
+    else
+      asio::async_read_until(socket_, buffer_, "\r\n\r\n", handler);
+  }
+
+  void readBody() {
+    if (buffer_.size() >= bodyLength_) {
+      buffer_.consume(bodyLength_);
+      complete();
+      return;
+    }
+    auto self(shared_from_this());
+    auto handler = [this, self](asio::error_code error, size_t) {
+      if (error)
+        fail();
+      else
+        readBody();
+    };
+    auto rest = asio::transfer_exactly(bodyLength_ - buffer_.size());
+    if (tls_)
+      asio::async_read(*tls_, buffer_, rest, handler);
+    else
+      asio::async_read(socket_, buffer_, rest, handler);
+  }
+
+  void complete() {
+    latencies_.push_back(chrono::duration_cast<chrono::microseconds>(
+                             chrono::steady_clock::now() - start_)
+                             .count());
+    ++run_.completed;
+    run_.bytes += bodyLength_;
+    if (close_)
+      reset();
+    next();
+  }
+
+  void fail() {
+    ++run_.errors;
+    reset();
+    next();
+  }
+
+  void reset() {
+    if (tls_) {
+      // TLS 1.3 sends the session in a ticket after the handshake, so it is
+      // taken only once a response has come back. Freeing a connection not
+      // shut down would mark its session unfit for resumption.
+      SSL *ssl = tls_->native_handle();
+      SSL_set_shutdown(ssl, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+      if (SSL_SESSION *session = SSL_get1_session(ssl)) {
+        if (session_)
+          SSL_SESSION_free(session_);
+        session_ = session;
+      }
+      tls_.reset();
+    }
+    asio::error_code ignored_ec;
+    socket_.close(ignored_ec);
+    buffer_.consume(buffer_.size());
+  }
+
+  tcp::socket socket_;
+  unique_ptr<TlsStream> tls_; // Over socket_, for HTTPS.
+  SSL_SESSION *session_ = nullptr;
+  Run &run_;
+  size_t next_;
+  const string *request_ = nullptr;
+  asio::streambuf buffer_;
+  size_t bodyLength_ = 0;
+  bool close_ = false;
+  chrono::steady_clock::time_point start_;
+  vector<uint32_t> latencies_;
+};
+
+static uint32_t percentile(const vector<uint32_t> &sorted, double p) {
+  if (sorted.empty())
+    return 0;
+  size_t i = static_cast<size_t>(p * (sorted.size() - 1) + 0.5);
+  return sorted[min(i, sorted.size() - 1)];
+}
+
+static void report(Run &run, chrono::steady_clock::duration elapsed) {
+  double seconds = chrono::duration<double>(elapsed).count();
+  sort(run.latencies.begin(), run.latencies.end());
+  const auto &l = run.latencies;
+  printf("requests    %ld ok, %ld errors in %.3f s\n", run.completed.load(),
+         run.errors.load(), seconds);
+  printf("throughput  %.0f req/s, %.2f MB/s\n", run.completed / seconds,
+         run.bytes / seconds / (1024 * 1024));
+  printf("latency us  p50 %u  p99 %u  p999 %u  max %u\n", percentile(l, 0.5),
+         percentile(l, 0.99), percentile(l, 0.999), l.empty() ? 0 : l.back());
+  if (run.tls)
+    printf("handshakes  %ld full, %ld resumed, %.0f/s\n",
+           run.fullHandshakes.load(), run.resumedHandshakes.load(),
+           (run.fullHandshakes + run.resumedHandshakes) / seconds);
+  if (run.tls && run.records)
+    printf("records     %ld received, %.0f bytes each, %.1f per response\n",
+           run.records.load(),
+           static_cast<double>(run.recordBytes) / run.records,
+           static_cast<double>(run.records) / max(run.completed.load(), 1L));
+}
+}
+
+int main(int argc, char **argv) {
+  string ip;
+  string port;
+  string fixtureDir;
+  unsigned connections = 64;
+  unsigned threads = 1;
+  long requests = 100000;
+  unsigned duration = 0;
+  bool keepAlive = false;
+  bool tls = false;
+  bool resume = true;
+  vector<string> paths;
+
+  static const struct option longopts[] = {
+      {"connections", required_argument, NULL, 'c'},
+      {"requests", required_argument, NULL, 'n'},
+      {"duration", required_argument, NULL, 'D'},
+      {"threads", required_argument, NULL, 't'},
+      {"keep-alive", no_argument, NULL, 'k'},
+      {"url", required_argument, NULL, 'u'},
+      {"fixture", required_argument, NULL, 'g'},
+      {"tls", no_argument, NULL, 'S'},
+      {"no-resume", no_argument, NULL, 'R'},
+      {NULL, 0, NULL, 0},
+  };
+
+  int c;
+  int errflg = 0;
+  opterr = 0;
+  while ((c = getopt_long(argc, argv, "h:p:c:n:D:t:ku:g:SR", longopts,
+                          NULL)) != -1) {
+    switch (c) {
+    case 'h':
+      ip = optarg;
+      break;
+    case 'p':
+      port = optarg;
+      break;
+    case 'c':
+      connections = atoi(optarg);
+      break;
+    case 'n':
+      requests = atol(optarg);
+      break;
+    case 'D':
+      duration = atoi(optarg);
+      break;
+    case 't':
+      threads = max(atoi(optarg), 1);
+      break;
+    case 'k':
+      keepAlive = true;
+      break;
+    case 'u':
+      paths.push_back(optarg);
+      break;
+    case 'g':
+      fixtureDir = optarg;
+      break;
+    case 'S':
+      tls = true;
+      break;
+    case 'R':
+      resume = false;
+      break;
+    case '?':
+      fprintf(stderr, "Unrecognized option: -%c\n", optopt);
+      errflg++;
+    }
+  }
+
+  if (!fixtureDir.empty()) {
+    if (!Bench::writeFixture(fixtureDir)) {
+      fprintf(stderr, "Cannot write fixture to %s\n", fixtureDir.c_str());
+      return 1;
+    }
+    printf("Fixture written; serve it with: final -h 127.0.0.1 -p <port> "
+           "-d %s\n",
+           fixtureDir.c_str());
+    return 0;
+  }
+
+  if (errflg || ip.empty() || port.empty() || connections == 0) {
+    fprintf(stderr, "usage: -h <ip> -p <port> [-c <connections>] "
+                    "[-n <requests>] [-D <seconds>] [-t <threads>] [-k] "
+                    "[-u <path>]... [-S [-R]]\n"
+                    "       -g <fixture directory>\n");
+    return 2;
+  }
+  if (paths.empty())
+    paths.push_back("/index.html");
+  if (ip == "localhost")
+    ip = "127.0.0.1";
+
+  try {
+    Bench::Run run;
+    run.endpoint =
+        tcp::endpoint(asio::ip::address::from_string(ip), stoi(port));
+    run.keepAlive = keepAlive;
+    if (tls) {
+      // The certificate is not checked; the handshake is what is measured.
+      run.tls.reset(new asio::ssl::context(asio::ssl::context::sslv23_client));
+      run.tls->set_verify_mode(asio::ssl::verify_none);
+      SSL_CTX_set_msg_callback(run.tls->native_handle(), Bench::countRecord);
+      SSL_CTX_set_msg_callback_arg(run.tls->native_handle(), &run);
+      run.resume = resume;
+    }
+    for (const auto &path : paths)
+      run.requests.push_back(keepAlive ? "GET " + path + " HTTP/1.1\r\nHost: " +
+                                             ip + "\r\n\r\n"
+                                       : "GET " + path + " HTTP/1.0\r\n\r\n");
+    if (duration) {
+      run.remaining = numeric_limits<long>::max();
+      run.deadline = chrono::steady_clock::now() + chrono::seconds(duration);
+    } else {
+      run.remaining = requests;
+    }
+
+    asio::io_service service;
+    for (unsigned i = 0; i < connections; ++i)
+      make_shared<Bench::Connection>(service, run, i)->start();
+
+    auto start = chrono::steady_clock::now();
+    vector<thread> workers;
+    for (unsigned i = 1; i < threads; ++i)
+      workers.emplace_back([&service] { service.run(); });
+    service.run();
+    for (auto &w : workers)
+      w.join();
+    Bench::report(run, chrono::steady_clock::now() - start);
+  } catch (const exception &e) {
+    cerr << "Exception: " << e.what() << "\n";
+    return 1;
+  }
+  return 0;
+}
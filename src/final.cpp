@@ -1,258 +1,3588 @@
+#include <algorithm>
+#include <array>
 #include <asio.hpp>
+#include <asio/ssl.hpp>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
-#include <fstream>
+#include <cstring>
+#include <deque>
+#include <functional>
 #include <iostream>
+#include <limits>
+#include <list>
 #include <memory>
+#include <mutex>
+#include <openssl/core_names.h>
+#include <openssl/rand.h>
+#include <sstream>
 #include <string>
 #include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
-#ifndef WIN32
+#include "pack_format.hpp"
+#include "representation.hpp"
+#include "url_decode.hpp"
 
+#include <fcntl.h>
 #include <getopt.h>
+#include <pthread.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
-#else
+#ifdef __linux__
+#include <sched.h>
+#include <sys/inotify.h>
+#include <sys/sendfile.h>
+#endif
 
 ///////////////////////////////////////////////////////////////////////////////
-// getopt.h
+// final -h <ip> -p <port> (-d <directory> | -P <pack file>)
+//       [-t <threads>] [-s <shards>] [-c <cache megabytes>]
+//       [-z <gzip cache megabytes>] [-o <open files>]
+//       [-k <keep-alive seconds>] [-T <header timeout seconds>]
+//       [-w <send timeout seconds>] [-m <max requests>]
+//       [-q <codel target milliseconds>] [-b <accept backlog>]
+//       [-l <method,path,status,bytes,latency>] [-M <metrics port>]
+//       [-U <upgrade socket>]
+//       [-S <tls port> -C <certificate chain file> -K <private key file>
+//        [-H <handshake threads>] [-r <small record kilobytes>]]
 ///////////////////////////////////////////////////////////////////////////////
 
-extern const int no_argument;
-extern const int required_argument;
-extern const int optional_argument;
+using namespace std;
+using asio::ip::tcp;
+using asio::local::stream_protocol;
+
+// One access log line, or a free-form message, in a fixed-size slot.
+struct LogRecord {
+  enum class Kind : char {
+    Access,
+    Message,
+  };
+
+  Kind kind = Kind::Message;
+  int status = 0;
+  uint64_t bytes = 0;
+  uint32_t latency = 0; // Microseconds.
+  int64_t time = 0;     // Microseconds since the epoch.
+  char method[16];
+  char text[200]; // The request path or the message.
+
+  static void copy(char *dst, size_t capacity, const char *src, size_t size) {
+    size = min(size, capacity - 1);
+    memcpy(dst, src, size);
+    dst[size] = '\0';
+  }
+};
+
+// Writes log records from a dedicated thread. Producers copy a record into a
+// bounded lock-free ring and never wait: when the ring is full the record is
+// dropped and counted. The writer drains the ring in batches, one writev per
+// batch.
+class AccessLog {
+public:
+  // Fields of an access record that get written.
+  enum Field {
+    Method = 1 << 0,
+    Path = 1 << 1,
+    Status = 1 << 2,
+    Bytes = 1 << 3,
+    Latency = 1 << 4,
+    AllFields = (1 << 5) - 1,
+  };
+
+  static const size_t capacity = 8192; // A power of two.
+  static const size_t max_batch = 64;
+
+  AccessLog(const string &path, unsigned fields)
+      : fields_{fields}, cells_{new Cell[capacity]} {
+    for (size_t i = 0; i < capacity; ++i)
+      cells_[i].sequence.store(i, memory_order_relaxed);
+    fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (fd_ >= 0)
+      writer_ = thread([this] { drain(); });
+  }
+
+  ~AccessLog() {
+    stop_ = true;
+    if (writer_.joinable())
+      writer_.join();
+    if (fd_ >= 0)
+      ::close(fd_);
+  }
+
+  // Parses a comma separated list of field names.
+  static bool parseFields(const string &list, unsigned &fields) {
+    static const char *const names[] = {"method", "path", "status", "bytes",
+                                        "latency"};
+    fields = 0;
+    stringstream ss(list);
+    string name;
+    while (getline(ss, name, ',')) {
+      auto it = find(begin(names), end(names), name);
+      if (it == end(names))
+        return false;
+      fields |= 1 << (it - begin(names));
+    }
+    return true;
+  }
+
+  void message(const string &text) {
+    LogRecord record;
+    record.kind = LogRecord::Kind::Message;
+    record.method[0] = '\0';
+    LogRecord::copy(record.text, sizeof(record.text), text.data(),
+                    text.size());
+    push(record);
+  }
+
+  // Queues a record unless the ring is full.
+  void push(LogRecord &record) {
+    if (fd_ < 0)
+      return;
+    record.time = chrono::duration_cast<chrono::microseconds>(
+                      chrono::system_clock::now().time_since_epoch())
+                      .count();
+
+    // Bounded MPMC queue after Dmitry Vyukov: a cell whose sequence equals
+    // the position is free for that position's producer.
+    size_t pos = tail_.load(memory_order_relaxed);
+    for (;;) {
+      Cell &cell = cells_[pos & (capacity - 1)];
+      size_t seq = cell.sequence.load(memory_order_acquire);
+      intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+      if (diff == 0) {
+        if (tail_.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+          cell.record = record;
+          cell.sequence.store(pos + 1, memory_order_release);
+          return;
+        }
+      } else if (diff < 0) {
+        dropped_.fetch_add(1, memory_order_relaxed);
+        return;
+      } else {
+        pos = tail_.load(memory_order_relaxed);
+      }
+    }
+  }
+
+  uint64_t dropped() const { return dropped_.load(memory_order_relaxed); }
+
+private:
+  struct Cell {
+    atomic<size_t> sequence;
+    LogRecord record;
+  };
+
+  // Only the writer thread pops, so the head needs no atomic update.
+  bool pop(LogRecord &record) {
+    Cell &cell = cells_[head_ & (capacity - 1)];
+    if (cell.sequence.load(memory_order_acquire) != head_ + 1)
+      return false;
+    record = cell.record;
+    cell.sequence.store(head_ + capacity, memory_order_release);
+    ++head_;
+    return true;
+  }
 
-extern char *optarg;
-extern int optind, opterr, optopt;
+  // Appends to the line at n, cutting the text short where the line ends so
+  // that n never passes the last byte, which is left for the newline.
+  template <typename... Args>
+  static void append(char *line, size_t size, size_t &n, const char *format,
+                     Args... args) {
+    if (n + 1 >= size)
+      return;
+    int written = snprintf(line + n, size - n, format, args...);
+    if (written > 0)
+      n = min(n + written, size - 1);
+  }
 
-struct option {
-  const char *name;
-  int has_arg;
-  int *flag;
-  int val;
+  size_t format(const LogRecord &record, char *line, size_t size) const {
+    size_t n = 0;
+    append(line, size, n, "%lld.%06lld",
+           static_cast<long long>(record.time / 1000000),
+           static_cast<long long>(record.time % 1000000));
+    if (record.kind == LogRecord::Kind::Message) {
+      append(line, size, n, " %s", record.text);
+    } else {
+      if (fields_ & Method)
+        append(line, size, n, " %s", record.method[0] ? record.method : "-");
+      if (fields_ & Path)
+        append(line, size, n, " %s", record.text[0] ? record.text : "-");
+      if (fields_ & Status)
+        append(line, size, n, " %d", record.status);
+      if (fields_ & Bytes)
+        append(line, size, n, " %llu",
+               static_cast<unsigned long long>(record.bytes));
+      if (fields_ & Latency)
+        append(line, size, n, " %uus", record.latency);
+    }
+    line[n++] = '\n';
+    return n;
+  }
+
+  void drain() {
+    static const size_t line_size = 512;
+    vector<char> lines(max_batch * line_size);
+    iovec iov[max_batch];
+    LogRecord record;
+    uint64_t reported = 0;
+    for (;;) {
+      bool stopping = stop_;
+      size_t count = 0;
+      while (count < max_batch && pop(record)) {
+        char *line = &lines[count * line_size];
+        iov[count].iov_base = line;
+        iov[count].iov_len = format(record, line, line_size);
+        ++count;
+      }
+      if (count < max_batch && dropped() != reported) {
+        reported = dropped();
+        LogRecord note;
+        note.time = chrono::duration_cast<chrono::microseconds>(
+                        chrono::system_clock::now().time_since_epoch())
+                        .count();
+        snprintf(note.text, sizeof(note.text), "Dropped %llu records",
+                 static_cast<unsigned long long>(reported));
+        char *line = &lines[count * line_size];
+        iov[count].iov_base = line;
+        iov[count].iov_len = format(note, line, line_size);
+        ++count;
+      }
+      if (count > 0) {
+        if (writev(fd_, iov, count) < 0 && errno != EINTR)
+          return;
+      } else if (stopping) {
+        return;
+      } else {
+        this_thread::sleep_for(chrono::milliseconds(5));
+      }
+    }
+  }
+
+  unsigned fields_;
+  unique_ptr<Cell[]> cells_;
+  // Keeps the producers' position off the cache lines read by the writer.
+  char padding0_[64];
+  atomic<size_t> tail_{0};
+  char padding1_[64];
+  size_t head_ = 0;
+  atomic<uint64_t> dropped_{0};
+  atomic<bool> stop_{false};
+  int fd_ = -1;
+  thread writer_;
 };
 
-int getopt(int argc, char *const argv[], const char *optstring);
+static AccessLog *log_;
+
+namespace HttpServer {
 
+#ifdef SO_REUSEPORT
+typedef asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>
+    reuse_port;
+#endif
+
+#ifdef SO_TIMESTAMPNS
+// Has the kernel tell when it received the data of each read, which accepted
+// sockets inherit from the listening one.
+typedef asio::detail::socket_option::boolean<SOL_SOCKET, SO_TIMESTAMPNS>
+    receive_timestamps;
+#endif
+
+static const string notFoundContent = "<html>"
+                                      "<head><title>Not Found</title></head>"
+                                      "<body><h1>404 Not Found</h1></body>"
+                                      "</html>";
+
+static const string notFound = "HTTP/1.1 404 Not Found\r\nContent-Length: " +
+                               to_string(notFoundContent.size()) +
+                               "\r\nContent-Type: text/html\r\n\r\n" +
+                               notFoundContent;
+
+static const string badRequestContent =
+    "<html>"
+    "<head><title>Bad Request</title></head>"
+    "<body><h1>400 Bad Request</h1></body>"
+    "</html>";
+
+static const string badRequest =
+    "HTTP/1.1 400 Bad Request\r\nContent-Length: " +
+    to_string(badRequestContent.size()) +
+    "\r\nContent-Type: text/html\r\n\r\n" + badRequestContent;
+
+static const string serviceUnavailableContent =
+    "<html>"
+    "<head><title>Service Unavailable</title></head>"
+    "<body><h1>503 Service Unavailable</h1></body>"
+    "</html>";
+
+static const string serviceUnavailable =
+    "HTTP/1.1 503 Service Unavailable\r\nContent-Length: " +
+    to_string(serviceUnavailableContent.size()) +
+    "\r\nContent-Type: text/html\r\nRetry-After: 1\r\n\r\n" +
+    serviceUnavailableContent;
+
+// A view of bytes owned elsewhere, such as the session read buffer.
+struct StringRef {
+  StringRef() = default;
+  StringRef(const char *data, size_t size) : data{data}, size{size} {}
+
+  string str() const { return string(data, size); }
+  bool empty() const { return size == 0; }
+
+  bool operator==(const char *other) const {
+    return strlen(other) == size && memcmp(data, other, size) == 0;
+  }
+  bool operator!=(const char *other) const { return !(*this == other); }
+
+  // Compares with a lower-case literal ignoring the case of this view.
+  bool iequals(const char *lower) const {
+    for (size_t i = 0; i < size; ++i, ++lower)
+      if (!*lower || tolower(static_cast<unsigned char>(data[i])) != *lower)
+        return false;
+    return !*lower;
+  }
+
+  // Looks for a lower-case token in a comma separated header value.
+  bool hasToken(const char *lower) const {
+    const char *p = data;
+    const char *end = data + size;
+    while (p < end) {
+      const char *comma = static_cast<const char *>(memchr(p, ',', end - p));
+      const char *next = comma ? comma : end;
+      while (p < next && (*p == ' ' || *p == '\t'))
+        ++p;
+      const char *last = next;
+      while (last > p && (last[-1] == ' ' || last[-1] == '\t'))
+        --last;
+      if (StringRef(p, last - p).iequals(lower))
+        return true;
+      p = next + 1;
+    }
+    return false;
+  }
+
+  const char *data = nullptr;
+  size_t size = 0;
+};
+
+// An open file descriptor together with the stamp it had when opened.
+class File {
+public:
+  File() = default;
+  File(const File &) = delete;
+  File &operator=(const File &) = delete;
+  ~File() { close(); }
+
+  // Only opens regular files; O_NONBLOCK keeps a FIFO from blocking open.
+  bool open(const string &path) {
+    close();
+    fd_ = ::open(path.c_str(), O_RDONLY | O_NONBLOCK);
+    if (fd_ < 0)
+      return false;
+    struct stat st;
+    if (fstat(fd_, &st) != 0 || !S_ISREG(st.st_mode)) {
+      close();
+      return false;
+    }
+    stamp_ = FileStamp(st);
+    return true;
+  }
+
+  void close() {
+    if (fd_ >= 0)
+      ::close(fd_);
+    fd_ = -1;
+    stamp_ = FileStamp();
+  }
+
+  // Reads the whole file into out starting at out[offset].
+  bool readAll(string &out, size_t offset) const {
+    out.resize(offset + size());
+    size_t done = 0;
+    while (done < size()) {
+      ssize_t n = pread(fd_, &out[offset + done], size() - done, done);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return false;
+      done += n;
+    }
+    return true;
+  }
+
+  int fd() const { return fd_; }
+  size_t size() const { return stamp_.size; }
+  const FileStamp &stamp() const { return stamp_; }
+
+private:
+  int fd_ = -1;
+  FileStamp stamp_;
+};
+
+// Keeps files open between requests, so that sending a file that is already
+// open takes no path walk, open or stat. An open file is shared by all the
+// sessions sending it, which only read it at explicit offsets. Files are kept
+// in an LRU per shard of the path space, each shard under a lock of its own.
+// An entry is checked against its path again after ttl; inotify, where
+// available, drops entries as soon as their file changes, and entries whose
+// directory it watches, along with every directory above it up to the root,
+// are trusted for watched_ttl instead. Watching the parent alone would miss
+// an ancestor being renamed or replaced.
+class FileCache {
+public:
+  static const size_t shard_count = 16;
+  static const size_t max_watches = 8192;
+
+  explicit FileCache(size_t capacity)
+      : capacity_{(capacity + shard_count - 1) / shard_count} {}
+
+  ~FileCache() { stop(); }
+
+  bool enabled() const { return capacity_ > 0; }
+
+  // Starts watching for changes to the files below root on a thread of its
+  // own.
+  void start(const string &root) {
+#ifdef __linux__
+    if (!enabled())
+      return;
+    root_ = root;
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0)
+      return;
+    inotify_ = fd;
+    descriptor_.reset(new asio::posix::stream_descriptor(service_, fd));
+    readEvents();
+    thread_ = thread([this] { service_.run(); });
+#endif
+  }
+
+  void stop() {
+    service_.stop();
+    if (thread_.joinable())
+      thread_.join();
+#ifdef __linux__
+    descriptor_.reset();
+    inotify_ = -1;
+#endif
+  }
+
+  // Returns the regular file at path opened, or nullptr if there is none.
+  shared_ptr<const File> find(const string &path) {
+    if (!enabled())
+      return open(path);
+
+    auto now = chrono::steady_clock::now();
+    Shard &shard = shardOf(path);
+    shared_ptr<const File> file;
+    {
+      lock_guard<mutex> lock(shard.mutex_);
+      auto it = shard.index_.find(path);
+      if (it != shard.index_.end()) {
+        if (now < it->second->expires) {
+          shard.lru_.splice(shard.lru_.begin(), shard.lru_, it->second);
+          return it->second->file;
+        }
+        file = it->second->file;
+      }
+    }
+
+    // The watch goes first so that no change after the check goes unseen.
+    bool watched = watch(path);
+    if (file) {
+      struct stat st;
+      if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode) ||
+          FileStamp(st) != file->stamp())
+        file = nullptr;
+    }
+    if (!file)
+      file = open(path);
+    if (!file) {
+      erase(path);
+      return nullptr;
+    }
+
+    lock_guard<mutex> lock(shard.mutex_);
+    auto it = shard.index_.find(path);
+    if (it != shard.index_.end()) {
+      shard.lru_.erase(it->second);
+      shard.index_.erase(it);
+    }
+    shard.lru_.push_front(
+        Entry{path, file, now + (watched ? watched_ttl : ttl)});
+    shard.index_[path] = shard.lru_.begin();
+    while (shard.lru_.size() > capacity_) {
+      shard.index_.erase(shard.lru_.back().path);
+      shard.lru_.pop_back();
+    }
+    return file;
+  }
+
+private:
+  static constexpr chrono::seconds ttl{1};
+  static constexpr chrono::seconds watched_ttl{60};
+
+  struct Entry {
+    string path;
+    shared_ptr<const File> file;
+    chrono::steady_clock::time_point expires;
+  };
+
+  struct Shard {
+    mutex mutex_;
+    list<Entry> lru_;
+    unordered_map<string, list<Entry>::iterator> index_;
+  };
+
+  static shared_ptr<const File> open(const string &path) {
+    auto file = make_shared<File>();
+    if (!file->open(path))
+      return nullptr;
+    return file;
+  }
+
+  Shard &shardOf(const string &path) {
+    return shards_[hash<string>()(path) % shard_count];
+  }
+
+  void erase(const string &path) {
+    Shard &shard = shardOf(path);
+    lock_guard<mutex> lock(shard.mutex_);
+    auto it = shard.index_.find(path);
+    if (it != shard.index_.end()) {
+      shard.lru_.erase(it->second);
+      shard.index_.erase(it);
+    }
+  }
+
+  // Erases every entry whose path starts with prefix; an empty prefix
+  // erases them all.
+  void erasePrefix(const string &prefix) {
+    for (auto &shard : shards_) {
+      lock_guard<mutex> lock(shard.mutex_);
+      for (auto it = shard.lru_.begin(); it != shard.lru_.end();) {
+        if (it->path.compare(0, prefix.size(), prefix) == 0) {
+          shard.index_.erase(it->path);
+          it = shard.lru_.erase(it);
+        } else {
+          ++it;
+        }
+      }
+    }
+  }
+
+#ifdef __linux__
+  // Watches the directory of path and each directory above it up to the
+  // root, returning whether they are all watched.
+  bool watch(const string &path) {
+    if (inotify_ < 0 || root_.empty() || path.size() <= root_.size() ||
+        path.compare(0, root_.size(), root_) != 0 ||
+        path[root_.size()] != '/')
+      return false;
+    lock_guard<mutex> lock(watchMutex_);
+    for (size_t slash = path.rfind('/');; slash = path.rfind('/', slash - 1)) {
+      string dir = slash > root_.size() ? path.substr(0, slash) : root_;
+      if (!watched_.count(dir)) {
+        if (dirs_.size() >= max_watches)
+          return false;
+        int wd = inotify_add_watch(inotify_, dir.c_str(),
+                                   IN_ONLYDIR | IN_ATTRIB | IN_MODIFY |
+                                       IN_CLOSE_WRITE | IN_CREATE |
+                                       IN_DELETE | IN_MOVED_FROM |
+                                       IN_MOVED_TO | IN_DELETE_SELF |
+                                       IN_MOVE_SELF);
+        if (wd < 0)
+          return false;
+        dirs_[wd] = dir;
+        watched_.insert(dir);
+      }
+      if (slash <= root_.size())
+        return true;
+    }
+  }
+
+  // Stops watching the directories below dir, whose paths no longer name
+  // them once dir has gone. Called with watchMutex_ held.
+  void unwatchBelow(const string &dir) {
+    string prefix = dir + "/";
+    for (auto it = dirs_.begin(); it != dirs_.end();) {
+      if (it->second.compare(0, prefix.size(), prefix) == 0) {
+        inotify_rm_watch(inotify_, it->first);
+        watched_.erase(it->second);
+        it = dirs_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+
+  void readEvents() {
+    descriptor_->async_read_some(
+        asio::buffer(events_), [this](asio::error_code error, size_t length) {
+          if (error)
+            return;
+          for (size_t p = 0; p + sizeof(inotify_event) <= length;) {
+            const inotify_event *event =
+                reinterpret_cast<const inotify_event *>(events_ + p);
+            handle(*event);
+            p += sizeof(inotify_event) + event->len;
+          }
+          readEvents();
+        });
+  }
+
+  // Drops the entries an event may have made stale. A directory that is
+  // renamed or removed takes every entry and watch below it along.
+  void handle(const inotify_event &event) {
+    if (event.mask & IN_Q_OVERFLOW) {
+      erasePrefix("");
+      return;
+    }
+    string dir;
+    {
+      lock_guard<mutex> lock(watchMutex_);
+      auto it = dirs_.find(event.wd);
+      if (it == dirs_.end())
+        return;
+      dir = it->second;
+      if (event.mask & IN_IGNORED) {
+        watched_.erase(dir);
+        dirs_.erase(it);
+      }
+      if (event.mask & (IN_IGNORED | IN_MOVE_SELF))
+        unwatchBelow(dir);
+    }
+    if (event.mask & (IN_IGNORED | IN_MOVE_SELF)) {
+      if (event.mask & IN_MOVE_SELF)
+        inotify_rm_watch(inotify_, event.wd);
+      erasePrefix(dir + "/");
+      return;
+    }
+    if (event.len == 0)
+      return;
+    string path = dir + "/" + event.name;
+    erase(path);
+    if (event.mask & IN_ISDIR)
+      erasePrefix(path + "/");
+  }
+#else
+  bool watch(const string &) { return false; }
+#endif
+
+  size_t capacity_; // Per shard.
+  Shard shards_[shard_count];
+  asio::io_service service_;
+  thread thread_;
+#ifdef __linux__
+  int inotify_ = -1;
+  string root_;
+  unique_ptr<asio::posix::stream_descriptor> descriptor_;
+  mutex watchMutex_;
+  unordered_map<int, string> dirs_;
+  unordered_set<string> watched_;
+  alignas(inotify_event) char events_[64 * 1024];
+#endif
+};
+
+constexpr chrono::seconds FileCache::ttl;
+constexpr chrono::seconds FileCache::watched_ttl;
+
+// The most preferred of a set of codings, which always includes identity.
+static Encoding preferredEncoding(unsigned usable) {
+  for (size_t i = encoding_count; i-- > 1;)
+    if (usable & (1u << i))
+      return static_cast<Encoding>(i);
+  return Encoding::Identity;
+}
+
+// Parses Accept-Encoding into the set of codings the client takes.
+static unsigned acceptedEncodings(StringRef value) {
+  unsigned accepted = bitOf(Encoding::Identity);
+  unsigned rejected = 0;
+  bool star = false;
+  const char *p = value.data;
+  const char *end = value.data + value.size;
+  while (p < end) {
+    const char *comma = static_cast<const char *>(memchr(p, ',', end - p));
+    const char *next = comma ? comma : end;
+    const char *semicolon = static_cast<const char *>(memchr(p, ';', next - p));
+    const char *nameEnd = semicolon ? semicolon : next;
+    while (p < nameEnd && (*p == ' ' || *p == '\t'))
+      ++p;
+    while (nameEnd > p && (nameEnd[-1] == ' ' || nameEnd[-1] == '\t'))
+      --nameEnd;
+    StringRef name(p, nameEnd - p);
+
+    // Only "q=0" with any number of zero decimals refuses a coding.
+    bool refused = false;
+    if (semicolon) {
+      const char *q = semicolon + 1;
+      while (q < next && (*q == ' ' || *q == '\t'))
+        ++q;
+      if (next - q >= 3 && (q[0] == 'q' || q[0] == 'Q') && q[1] == '=') {
+        refused = true;
+        for (q += 2; q < next && *q != ' ' && *q != '\t'; ++q)
+          if (*q != '0' && *q != '.')
+            refused = false;
+      }
+    }
+
+    unsigned bits = 0;
+    if (name.iequals("gzip") || name.iequals("x-gzip"))
+      bits = bitOf(Encoding::Gzip);
+    else if (name.iequals("br"))
+      bits = bitOf(Encoding::Brotli);
+    else if (name == "*")
+      star = !refused;
+    (refused ? rejected : accepted) |= bits;
+    p = next + 1;
+  }
+  if (star)
+    accepted |= ~rejected & ((1u << encoding_count) - 1);
+  return accepted & ~rejected;
+}
+
+// Remembers which precompressed codings (foo.gz, foo.br) exist next to each
+// file, so that negotiating a coding costs no more system calls than serving
+// the file plainly. An entry is probed again when the file changes or when it
+// is older than probe_interval, which catches sidecars added, removed or
+// replaced on their own. Each sidecar's stamp is kept with the entry, so
+// that what was rendered from a sidecar can be checked against the sidecar
+// itself. The entries are sharded by path, each shard under a lock of its
+// own.
+class SidecarCache {
+public:
+  static const size_t shard_count = 16;
+  static const size_t max_entries = 65536;
+
+  // The codings available for a file, and the stamp of the file holding
+  // each of them.
+  struct Sidecars {
+    unsigned encodings;
+    FileStamp stamps[encoding_count];
+  };
+
+  // Returns the codings available for the file at path, always including
+  // identity. A sidecar older than the file does not count.
+  Sidecars find(const string &path, const FileStamp &stamp) {
+    auto now = chrono::steady_clock::now();
+    Shard &shard = shards_[hash<string>()(path) % shard_count];
+    {
+      lock_guard<mutex> lock(shard.mutex_);
+      auto it = shard.entries_.find(path);
+      if (it != shard.entries_.end() &&
+          it->second.sidecars.stamps[0] == stamp &&
+          now - it->second.probed < probe_interval)
+        return it->second.sidecars;
+    }
+
+    Sidecars sidecars = {};
+    sidecars.encodings = bitOf(Encoding::Identity);
+    sidecars.stamps[0] = stamp;
+    for (size_t i = 1; i < encoding_count; ++i) {
+      struct stat st;
+      string sidecar = path + encodingSuffixes[i];
+      if (stat(sidecar.c_str(), &st) == 0 && S_ISREG(st.st_mode) &&
+          st.st_mtime >= stamp.mtime) {
+        sidecars.encodings |= 1u << i;
+        sidecars.stamps[i] = FileStamp(st);
+      }
+    }
+
+    lock_guard<mutex> lock(shard.mutex_);
+    if (shard.entries_.size() >= max_entries / shard_count)
+      shard.entries_.clear();
+    shard.entries_[path] = Entry{sidecars, now};
+    return sidecars;
+  }
+
+private:
+  static constexpr chrono::seconds probe_interval{5};
+
+  struct Entry {
+    Sidecars sidecars;
+    chrono::steady_clock::time_point probed;
+  };
+
+  struct Shard {
+    mutex mutex_;
+    unordered_map<string, Entry> entries_;
+  };
+
+  Shard shards_[shard_count];
+};
+
+constexpr chrono::seconds SidecarCache::probe_interval;
+
+// A size-bounded LRU of complete pre-rendered responses for small files, keyed
+// by decoded request path and coding and validated on each hit against the
+// stamps of the file and of the file the body was read from. Responses are
+// immutable and shared with the sessions writing them, so an eviction never
+// invalidates a response that is still being sent. Entries are spread over
+// shards by path, each with a lock and a share of the capacity of its own,
+// so that the threads of different shards of the server seldom meet on a
+// lock; a hit allocates nothing.
+class ResponseCache {
+public:
+  static const size_t shard_count = 16;
+  static const size_t max_entry_size = 1024 * 1024;
+
+  explicit ResponseCache(size_t capacity,
+                         size_t maxEntrySize = max_entry_size)
+      : capacity_{(capacity + shard_count - 1) / shard_count},
+        maxEntrySize_{maxEntrySize} {}
+
+  bool enabled() const { return capacity_ > 0; }
+
+  bool accepts(size_t size) const {
+    return size <= maxEntrySize_ && size <= capacity_;
+  }
+
+  shared_ptr<const string> find(const string &path, Encoding encoding,
+                                const FileStamp &stamp,
+                                const FileStamp &body) {
+    Shard &shard = shardOf(path);
+    auto &index = shard.index_[static_cast<int>(encoding)];
+    lock_guard<mutex> lock(shard.mutex_);
+    auto it = index.find(path);
+    if (it == index.end())
+      return nullptr;
+    if (it->second->stamp != stamp || it->second->body != body) {
+      shard.erase(it->second);
+      return nullptr;
+    }
+    shard.lru_.splice(shard.lru_.begin(), shard.lru_, it->second);
+    return it->second->response;
+  }
+
+  void insert(const string &path, Encoding encoding, const FileStamp &stamp,
+              const FileStamp &body, shared_ptr<const string> response) {
+    Shard &shard = shardOf(path);
+    auto &index = shard.index_[static_cast<int>(encoding)];
+    lock_guard<mutex> lock(shard.mutex_);
+    auto it = index.find(path);
+    if (it != index.end())
+      shard.erase(it->second);
+    shard.lru_.push_front(
+        Entry{path, encoding, stamp, body, move(response)});
+    index[path] = shard.lru_.begin();
+    shard.size_ += cost(shard.lru_.front());
+    while (shard.size_ > capacity_)
+      shard.erase(prev(shard.lru_.end()));
+  }
+
+private:
+  struct Entry {
+    string path;
+    Encoding encoding;
+    FileStamp stamp;
+    FileStamp body;
+    shared_ptr<const string> response;
+  };
+
+  static size_t cost(const Entry &entry) {
+    return entry.path.size() + entry.response->size();
+  }
+
+  struct Shard {
+    void erase(list<Entry>::iterator entry) {
+      size_ -= cost(*entry);
+      index_[static_cast<int>(entry->encoding)].erase(entry->path);
+      lru_.erase(entry);
+    }
+
+    mutex mutex_;
+    list<Entry> lru_;
+    // One index per coding, so that the request path alone is the key.
+    unordered_map<string, list<Entry>::iterator> index_[encoding_count];
+    size_t size_ = 0;
+  };
+
+  Shard &shardOf(const string &path) {
+    return shards_[hash<string>()(path) % shard_count];
+  }
+
+  Shard shards_[shard_count];
+  size_t capacity_; // Of every shard.
+  size_t maxEntrySize_;
+};
+
+// Gzips compressible files that have no .gz sidecar on a few background
+// threads, and keeps the results as complete pre-rendered responses in a
+// size-bounded LRU keyed by file path and validated against the file stamp.
+// Requests never wait for it: a file is sent as it is until its compressed
+// response is ready, and from then on the response costs no CPU at all. The
+// files waiting or skipped are sharded by path like the cache, each shard
+// under a lock of its own, so that requests for them seldom meet on a lock.
+class Compressor {
+public:
+  static const size_t shard_count = 16;
+  static const size_t min_size = 256;
+  static const size_t max_size = 16 * 1024 * 1024;
+  static const size_t max_pending = 64;
+  static const size_t max_skipped = 65536;
+
+  explicit Compressor(size_t capacity)
+      : cache_{capacity, numeric_limits<size_t>::max()} {}
+
+  ~Compressor() { stop(); }
+
+  void start(unsigned threads) {
+    if (!enabled())
+      return;
+    work_.reset(new asio::io_service::work(service_));
+    for (unsigned i = 0; i < threads; ++i)
+      threads_.emplace_back([this] { service_.run(); });
+  }
+
+  // Drops the files still waiting to be compressed.
+  void stop() {
+    work_.reset();
+    service_.stop();
+    for (auto &t : threads_)
+      t.join();
+    threads_.clear();
+  }
+
+  bool enabled() const { return cache_.enabled(); }
+
+  bool accepts(const Representation &rep) const {
+    return enabled() && rep.type->compressible &&
+           static_cast<size_t>(rep.stamp.size) >= min_size &&
+           static_cast<size_t>(rep.stamp.size) <= max_size;
+  }
+
+  // Returns the response with the gzipped file at path if it is ready, and
+  // has it compressed in the background otherwise.
+  shared_ptr<const string> find(const string &path,
+                                const Representation &rep) {
+    auto response = cache_.find(path, rep.encoding, rep.stamp, rep.stamp);
+    if (!response)
+      schedule(path, rep);
+    return response;
+  }
+
+private:
+  struct Shard {
+    mutex mutex_;
+    unordered_set<string> pending_;
+    unordered_map<string, FileStamp> skipped_;
+  };
+
+  Shard &shardOf(const string &path) {
+    return shards_[hash<string>()(path) % shard_count];
+  }
+
+  // At most about max_pending files wait at a time, counted over all
+  // shards without a lock of their own.
+  void schedule(const string &path, const Representation &rep) {
+    Shard &shard = shardOf(path);
+    {
+      lock_guard<mutex> lock(shard.mutex_);
+      auto it = shard.skipped_.find(path);
+      if (it != shard.skipped_.end() && it->second == rep.stamp)
+        return;
+      if (pending_.load(memory_order_relaxed) >= max_pending ||
+          !shard.pending_.insert(path).second)
+        return;
+      pending_.fetch_add(1, memory_order_relaxed);
+    }
+    service_.post([this, path, rep] { compress(path, rep); });
+  }
+
+  // Files that do not shrink, or that changed in the meantime, are skipped
+  // until their next version.
+  void compress(const string &path, const Representation &rep) {
+    File file;
+    string body;
+    string compressed;
+    bool ok = file.open(path) && file.stamp() == rep.stamp &&
+              file.readAll(body, 0) && gzip(body, compressed) &&
+              compressed.size() < body.size();
+    if (ok) {
+      auto response = make_shared<string>(headerFor(rep, compressed.size()));
+      *response += compressed;
+      ok = cache_.accepts(response->size());
+      if (ok)
+        cache_.insert(path, rep.encoding, rep.stamp, rep.stamp,
+                      move(response));
+    }
+
+    Shard &shard = shardOf(path);
+    lock_guard<mutex> lock(shard.mutex_);
+    shard.pending_.erase(path);
+    pending_.fetch_sub(1, memory_order_relaxed);
+    if (!ok) {
+      if (shard.skipped_.size() >= max_skipped / shard_count)
+        shard.skipped_.clear();
+      shard.skipped_[path] = rep.stamp;
+    }
+  }
+
+  ResponseCache cache_;
+  Shard shards_[shard_count];
+  atomic<size_t> pending_{0};
+  asio::io_service service_;
+  unique_ptr<asio::io_service::work> work_;
+  vector<thread> threads_;
+};
+
+enum class Result {
+  Ok,
+  NotFound,
+  BadRequest,
+  Error,
+  RangeNotSatisfiable,
+  NotModified,
+  Unavailable,
+};
+
+static const size_t result_count = 7;
+
+// What a connection was waiting for when it ran out of time.
+enum class Timeout {
+  Idle,   // The next request on a kept-alive connection.
+  Header, // The rest of a request head.
+  Send,   // Any progress in writing the response.
+};
+
+static const size_t timeout_count = 3;
+
+// How a TLS handshake went.
+enum class Handshake {
+  Full,
+  Resumed, // With a session from the cache or a ticket.
+  Failed,
+};
+
+static const size_t handshake_count = 3;
+
+// Request, byte, connection and latency counters in Prometheus terms. Every
+// thread updates counters of its own, padded onto separate cache lines, with
+// plain relaxed stores; they are only summed up when scraped.
+class Metrics {
+public:
+  // Upper bounds of the latency histogram buckets in microseconds.
+  static constexpr uint64_t latency_buckets[] = {
+      100,   250,    500,    1000,   2500,   5000,    10000,
+      25000, 50000,  100000, 250000, 500000, 1000000,
+  };
+  static const size_t bucket_count =
+      sizeof(latency_buckets) / sizeof(latency_buckets[0]) + 1;
+
+  void request(Result result, uint64_t bytes, uint64_t latency) {
+    Counters &c = local();
+    add(c.results[static_cast<size_t>(result)], 1);
+    add(c.bytes, bytes);
+    size_t bucket = 0;
+    while (bucket + 1 < bucket_count && latency > latency_buckets[bucket])
+      ++bucket;
+    add(c.latency[bucket], 1);
+    add(c.latencySum, latency);
+  }
+
+  void accepted() { add(local().accepted, 1); }
+  void sessionOpened(bool tls) {
+    Counters &c = local();
+    add(c.opened, 1);
+    if (tls)
+      add(c.tlsOpened, 1);
+  }
+  void sessionClosed(bool tls) {
+    Counters &c = local();
+    add(c.closed, 1);
+    if (tls)
+      add(c.tlsClosed, 1);
+  }
+  void timedOut(Timeout timeout) {
+    add(local().timeouts[static_cast<size_t>(timeout)], 1);
+  }
+  void handshake(Handshake handshake) {
+    add(local().handshakes[static_cast<size_t>(handshake)], 1);
+  }
+  void kernelTls() { add(local().kernelTls, 1); }
+
+  // Renders the sum over all threads in the Prometheus text format.
+  string render() const {
+    Counters total;
+    {
+      lock_guard<mutex> lock(mutex_);
+      for (const auto &c : threads_) {
+        for (size_t i = 0; i < result_count; ++i)
+          add(total.results[i], c->results[i]);
+        add(total.bytes, c->bytes);
+        add(total.accepted, c->accepted);
+        add(total.opened, c->opened);
+        add(total.closed, c->closed);
+        for (size_t i = 0; i < timeout_count; ++i)
+          add(total.timeouts[i], c->timeouts[i]);
+        for (size_t i = 0; i < handshake_count; ++i)
+          add(total.handshakes[i], c->handshakes[i]);
+        add(total.kernelTls, c->kernelTls);
+        add(total.tlsOpened, c->tlsOpened);
+        add(total.tlsClosed, c->tlsClosed);
+        for (size_t i = 0; i < bucket_count; ++i)
+          add(total.latency[i], c->latency[i]);
+        add(total.latencySum, c->latencySum);
+      }
+    }
+
+    static const char *const results[] = {
+        "ok", "not_found", "bad_request", "error", "range_not_satisfiable",
+        "not_modified", "unavailable"};
+    stringstream out;
+    out << "# TYPE http_requests_total counter\n";
+    for (size_t i = 0; i < result_count; ++i)
+      out << "http_requests_total{result=\"" << results[i] << "\"} "
+          << total.results[i] << "\n";
+    out << "# TYPE http_sent_bytes_total counter\n"
+        << "http_sent_bytes_total " << total.bytes << "\n"
+        << "# TYPE http_accepted_connections_total counter\n"
+        << "http_accepted_connections_total " << total.accepted << "\n"
+        << "# TYPE http_active_sessions gauge\n"
+        << "http_active_sessions " << total.opened - total.closed << "\n"
+        << "# TYPE http_timeouts_total counter\n";
+    static const char *const timeouts[] = {"idle", "header", "send"};
+    for (size_t i = 0; i < timeout_count; ++i)
+      out << "http_timeouts_total{phase=\"" << timeouts[i] << "\"} "
+          << total.timeouts[i] << "\n";
+    out << "# TYPE tls_handshakes_total counter\n";
+    static const char *const handshakes[] = {"full", "resumed", "failed"};
+    for (size_t i = 0; i < handshake_count; ++i)
+      out << "tls_handshakes_total{kind=\"" << handshakes[i] << "\"} "
+          << total.handshakes[i] << "\n";
+    out << "# TYPE tls_kernel_send_total counter\n"
+        << "tls_kernel_send_total " << total.kernelTls << "\n";
+
+    // Record buffers are lent to TLS sessions only while they read or write,
+    // so an idle session costs none of them.
+    uint64_t tlsSessions = total.tlsOpened - total.tlsClosed;
+    uint64_t inUse = asio::ssl::stream_base::buffer_bytes_in_use();
+    out << "# TYPE tls_active_sessions gauge\n"
+        << "tls_active_sessions " << tlsSessions << "\n"
+        << "# TYPE tls_buffer_bytes gauge\n"
+        << "tls_buffer_bytes{state=\"in_use\"} " << inUse << "\n"
+        << "tls_buffer_bytes{state=\"pooled\"} "
+        << asio::ssl::stream_base::buffer_bytes_pooled() << "\n"
+        << "# TYPE tls_buffer_bytes_per_session gauge\n"
+        << "tls_buffer_bytes_per_session "
+        << (tlsSessions ? inUse / tlsSessions : 0) << "\n"
+        << "# TYPE http_request_duration_seconds histogram\n";
+    uint64_t count = 0;
+    for (size_t i = 0; i < bucket_count; ++i) {
+      count += total.latency[i];
+      out << "http_request_duration_seconds_bucket{le=\"";
+      if (i + 1 < bucket_count)
+        out << latency_buckets[i] / 1e6;
+      else
+        out << "+Inf";
+      out << "\"} " << count << "\n";
+    }
+    out << "http_request_duration_seconds_sum " << total.latencySum / 1e6
+        << "\n"
+        << "http_request_duration_seconds_count " << count << "\n";
+    if (log_)
+      out << "# TYPE http_log_dropped_total counter\n"
+          << "http_log_dropped_total " << log_->dropped() << "\n";
+    return out.str();
+  }
+
+private:
+  struct Counters {
+    char padding0_[64];
+    atomic<uint64_t> results[result_count] = {};
+    atomic<uint64_t> bytes{0};
+    atomic<uint64_t> accepted{0};
+    atomic<uint64_t> opened{0};
+    atomic<uint64_t> closed{0};
+    atomic<uint64_t> timeouts[timeout_count] = {};
+    atomic<uint64_t> handshakes[handshake_count] = {};
+    atomic<uint64_t> kernelTls{0}; // Handshakes that left sending to kTLS.
+    atomic<uint64_t> tlsOpened{0};
+    atomic<uint64_t> tlsClosed{0};
+    atomic<uint64_t> latency[bucket_count] = {};
+    atomic<uint64_t> latencySum{0};
+    char padding1_[64];
+  };
+
+  // Only the owning thread writes a counter, so no read-modify-write is
+  // needed to make the increment safe.
+  static void add(atomic<uint64_t> &counter, uint64_t n) {
+    counter.store(counter.load(memory_order_relaxed) + n,
+                  memory_order_relaxed);
+  }
+
+  // Returns the counters of the calling thread, registering them on its
+  // first use. Counters outlive their thread so that no count is lost.
+  Counters &local() {
+    static thread_local const Metrics *owner = nullptr;
+    static thread_local Counters *counters = nullptr;
+    if (owner != this) {
+      lock_guard<mutex> lock(mutex_);
+      threads_.emplace_back(new Counters);
+      counters = threads_.back().get();
+      owner = this;
+    }
+    return *counters;
+  }
+
+  mutable mutex mutex_;
+  vector<unique_ptr<Counters>> threads_;
+};
+
+constexpr uint64_t Metrics::latency_buckets[];
+
+// Admission control after CoDel, in the form used for RPC servers. What is
+// measured is how long a request waits from the kernel receiving it until
+// the server gets to it, in the socket and in the io_service queue alike,
+// where the kernel gives receive timestamps as Linux does. The server counts
+// as overloaded for an interval when even the shortest wait of the interval
+// before exceeded target, that is when a standing queue has formed; it then
+// turns away what waited more than twice target, which drains the queue
+// while what is served is served quickly.
+class Admission {
+public:
+  static constexpr chrono::milliseconds interval{100};
+
+  bool enabled() const { return target_ > 0; }
+
+  void setTarget(chrono::steady_clock::duration target) {
+    target_ = chrono::duration_cast<chrono::nanoseconds>(target).count();
+  }
+
+  // Accounts for a wait, returning whether the work that waited is to be
+  // done.
+  bool admit(chrono::steady_clock::duration wait) {
+    int64_t now = chrono::duration_cast<chrono::nanoseconds>(
+                      chrono::steady_clock::now().time_since_epoch())
+                      .count();
+    int64_t w = chrono::duration_cast<chrono::nanoseconds>(wait).count();
+    int64_t end = intervalEnd_.load(memory_order_relaxed);
+    if (now > end) {
+      int64_t next = now + chrono::nanoseconds(interval).count();
+      if (intervalEnd_.compare_exchange_strong(end, next))
+        overloaded_.store(minWait_.exchange(w) > target_,
+                          memory_order_relaxed);
+    } else {
+      int64_t min = minWait_.load(memory_order_relaxed);
+      while (w < min && !minWait_.compare_exchange_weak(min, w))
+        ;
+    }
+    return !overloaded_.load(memory_order_relaxed) || w <= 2 * target_;
+  }
+
+private:
+  int64_t target_ = 0; // Nanoseconds; 0 admits everything unmeasured.
+  atomic<int64_t> intervalEnd_{0};
+  atomic<int64_t> minWait_{0};
+  atomic<bool> overloaded_{false};
+};
+
+constexpr chrono::milliseconds Admission::interval;
+
+// Sends one tag byte over a Unix socket with the descriptor fd attached,
+// unless fd is -1. Returns whether it was sent.
+static bool sendTagged(int socket, char tag, int fd) {
+  iovec iov{&tag, 1};
+  msghdr message{};
+  message.msg_iov = &iov;
+  message.msg_iovlen = 1;
+  char control[CMSG_SPACE(sizeof(int))];
+  if (fd >= 0) {
+    memset(control, 0, sizeof(control));
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    cmsghdr *c = CMSG_FIRSTHDR(&message);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(c), &fd, sizeof(int));
+  }
+  int flags = 0;
+#ifdef MSG_NOSIGNAL
+  flags = MSG_NOSIGNAL;
+#endif
+  ssize_t n;
+  do
+    n = ::sendmsg(socket, &message, flags);
+  while (n < 0 && errno == EINTR);
+  return n == 1;
+}
+
+// Receives one tag byte and the descriptor attached to it, or -1 in fd if
+// there is none. Returns what recvmsg does.
+static ssize_t receiveTagged(int socket, char &tag, int &fd) {
+  iovec iov{&tag, 1};
+  msghdr message{};
+  message.msg_iov = &iov;
+  message.msg_iovlen = 1;
+  char control[CMSG_SPACE(sizeof(int))];
+  message.msg_control = control;
+  message.msg_controllen = sizeof(control);
+  ssize_t n;
+  do
+    n = ::recvmsg(socket, &message, 0);
+  while (n < 0 && errno == EINTR);
+  fd = -1;
+  if (n > 0) {
+    for (cmsghdr *c = CMSG_FIRSTHDR(&message); c;
+         c = CMSG_NXTHDR(&message, c))
+      if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS)
+        memcpy(&fd, CMSG_DATA(c), sizeof(int));
+    if (fd >= 0)
+      fcntl(fd, F_SETFD, FD_CLOEXEC);
+  }
+  return n;
+}
+
+// The part of an upgrade that sessions take part in. Once the listeners are
+// with the successor, every connection that waits for its next request is
+// sent there over the Unix socket, which keeps it open across the move.
+// Sessions only queue their connections; they are sent by the thread of the
+// socket's io_service, which waits for the socket to take more whenever it
+// is full, so that a slow successor never holds up an I/O thread.
+class Handoff {
+public:
+  bool draining() const { return draining_.load(memory_order_relaxed); }
+
+  // Starts sending connections over successor, which stays the caller's and
+  // is only used from the thread running its io_service.
+  void begin(stream_protocol::socket &successor) {
+    asio::error_code ignored_ec;
+    successor.non_blocking(true, ignored_ec);
+    lock_guard<mutex> lock(mutex_);
+    successor_ = &successor;
+    draining_ = true;
+  }
+
+  // Stops sending. The connections still queued are closed. Called from the
+  // thread running the successor's io_service.
+  void end() {
+    lock_guard<mutex> lock(mutex_);
+    successor_ = nullptr;
+    dropQueued();
+  }
+
+  // Queues the connection on fd to be sent, returning whether it was taken.
+  // A duplicate of fd is sent, so the caller still has to close its own
+  // descriptor.
+  bool pass(int fd, bool admin) {
+    lock_guard<mutex> lock(mutex_);
+    if (!successor_)
+      return false;
+    int copy = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (copy < 0)
+      return false;
+    queue_.push_back(Passed{copy, admin ? 'M' : 'C'});
+    if (!sending_) {
+      sending_ = true;
+      successor_->get_io_service().post([this] { send(); });
+    }
+    return true;
+  }
+
+  // Whether connections are still queued or being sent.
+  bool sending() const {
+    lock_guard<mutex> lock(mutex_);
+    return sending_;
+  }
+
+  unsigned long passed() const {
+    lock_guard<mutex> lock(mutex_);
+    return passed_;
+  }
+
+private:
+  struct Passed {
+    int fd;
+    char tag;
+  };
+
+  // Sends the queued connections in order until the queue is empty or the
+  // socket is full. A successor that fails to take one gets no more.
+  void send() {
+    for (;;) {
+      Passed next;
+      stream_protocol::socket *successor;
+      {
+        lock_guard<mutex> lock(mutex_);
+        if (!successor_ || queue_.empty()) {
+          sending_ = false;
+          return;
+        }
+        next = queue_.front();
+        successor = successor_;
+      }
+      if (!sendTagged(successor->native_handle(), next.tag, next.fd)) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+          successor->async_write_some(
+              asio::null_buffers(), [this](asio::error_code error, size_t) {
+                if (error)
+                  fail();
+                else
+                  send();
+              });
+          return;
+        }
+        fail();
+        return;
+      }
+      ::close(next.fd);
+      lock_guard<mutex> lock(mutex_);
+      queue_.pop_front();
+      ++passed_;
+    }
+  }
+
+  void fail() {
+    lock_guard<mutex> lock(mutex_);
+    successor_ = nullptr;
+    dropQueued();
+  }
+
+  // Called with mutex_ held.
+  void dropQueued() {
+    for (const Passed &passed : queue_)
+      ::close(passed.fd);
+    queue_.clear();
+    sending_ = false;
+  }
+
+  mutable mutex mutex_;
+  stream_protocol::socket *successor_ = nullptr;
+  deque<Passed> queue_;
+  bool sending_ = false; // Whether send() is due or waits for the socket.
+  unsigned long passed_ = 0;
+  atomic<bool> draining_{false};
+};
+
+// TLS for the HTTPS listeners. A single context serves every worker thread,
+// so that a returning client can resume its session whichever thread or
+// shard it lands on: by session id from the context's server-side cache, or
+// with a ticket sealed by a key of ours. A new ticket key is made every
+// key_lifetime; tickets sealed with the one before are still taken for as
+// long again, and are renewed when they are.
+class Tls {
+public:
+  static constexpr chrono::seconds key_lifetime{3600};
+  static const long cache_size = 20480;
+
+  Tls(const string &certificate, const string &key)
+      : context_{asio::ssl::context::sslv23_server} {
+    context_.set_options(asio::ssl::context::default_workarounds |
+                         asio::ssl::context::single_dh_use);
+    context_.use_certificate_chain_file(certificate);
+    context_.use_private_key_file(key, asio::ssl::context::pem);
+    // Sessions try to leave the records they send to the kernel.
+    context_.enable_kernel_send();
+    SSL_CTX *ctx = context_.native_handle();
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(ctx, cache_size);
+    static const unsigned char id[] = "final";
+    SSL_CTX_set_session_id_context(ctx, id, sizeof(id) - 1);
+    SSL_CTX_set_ex_data(ctx, index(), this);
+    SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, &Tls::ticketKey);
+    keys_[0] = makeKey();
+  }
+
+  asio::ssl::context &context() { return context_; }
+
+private:
+  struct Key {
+    unsigned char name[16];
+    unsigned char aes[32];
+    unsigned char hmac[32];
+    chrono::steady_clock::time_point made;
+    bool valid = false;
+  };
+
+  static int index() {
+    static int index =
+        SSL_CTX_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+    return index;
+  }
+
+  static Key makeKey() {
+    Key key;
+    if (RAND_bytes(key.name, sizeof(key.name)) <= 0 ||
+        RAND_bytes(key.aes, sizeof(key.aes)) <= 0 ||
+        RAND_bytes(key.hmac, sizeof(key.hmac)) <= 0)
+      throw runtime_error("no randomness for TLS ticket keys");
+    key.made = chrono::steady_clock::now();
+    key.valid = true;
+    return key;
+  }
+
+  // The key to seal new tickets with, made anew once it is too old.
+  Key current() {
+    lock_guard<mutex> lock(mutex_);
+    if (chrono::steady_clock::now() - keys_[0].made >= key_lifetime) {
+      try {
+        Key key = makeKey();
+        keys_[1] = keys_[0];
+        keys_[0] = key;
+      } catch (const exception &) {
+        // Keep the old key a while longer rather than fail the handshake.
+      }
+    }
+    return keys_[0];
+  }
+
+  // The key a ticket names, if it is still taken. renew tells whether the
+  // ticket is to be replaced with one sealed by the current key.
+  bool find(const unsigned char *name, Key &key, bool &renew) {
+    lock_guard<mutex> lock(mutex_);
+    auto now = chrono::steady_clock::now();
+    for (size_t i = 0; i < 2; ++i) {
+      const Key &k = keys_[i];
+      if (k.valid && memcmp(k.name, name, sizeof(k.name)) == 0 &&
+          now - k.made < 2 * key_lifetime) {
+        key = k;
+        renew = i > 0 || now - k.made >= key_lifetime;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Seals or opens a session ticket, as OpenSSL asks.
+  static int ticketKey(SSL *ssl, unsigned char *name, unsigned char *iv,
+                       EVP_CIPHER_CTX *cipher, EVP_MAC_CTX *mac,
+                       int encrypt) {
+    Tls *tls =
+        static_cast<Tls *>(SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), index()));
+    Key key;
+    bool renew = false;
+    if (encrypt) {
+      key = tls->current();
+      memcpy(name, key.name, sizeof(key.name));
+      if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) <= 0)
+        return -1;
+    } else if (!tls->find(name, key, renew)) {
+      return 0; // Unknown or expired: a full handshake follows.
+    }
+    OSSL_PARAM params[] = {
+        OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key.hmac,
+                                          sizeof(key.hmac)),
+        OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST,
+                                         const_cast<char *>("SHA256"), 0),
+        OSSL_PARAM_construct_end()};
+    if (!EVP_MAC_CTX_set_params(mac, params) ||
+        !EVP_CipherInit_ex(cipher, EVP_aes_256_cbc(), nullptr, key.aes, iv,
+                           encrypt))
+      return -1;
+    return renew ? 2 : 1;
+  }
+
+  asio::ssl::context context_;
+  mutex mutex_;
+  Key keys_[2]; // The current key and the one before.
+};
+
+constexpr chrono::seconds Tls::key_lifetime;
+
+// State shared by all sessions of the server.
+struct Context {
+  Context(const string &dir, size_t cacheSize, size_t gzipCacheSize,
+          size_t openFiles)
+      : dir{dir}, files{openFiles}, cache{cacheSize},
+        compressor{gzipCacheSize} {}
+
+  string dir;
+  FileCache files;
+  ResponseCache cache;
+  SidecarCache sidecars;
+  Compressor compressor;
+  Metrics metrics;
+  Admission admission;
+  Handoff handoff;
+  // Set if the server listens for HTTPS.
+  unique_ptr<Tls> tls;
+  // Threads the TLS handshakes run their key exchanges and signatures on,
+  // so that a burst of new connections does not hold up the I/O of those
+  // established; inline on the I/O threads if not set.
+  asio::ssl::handshake_pool *handshakePool = nullptr;
+  // Bytes of every TLS connection sent in records of a single TCP segment,
+  // which the client can use as they arrive, before full-size records take
+  // over; 0 sends full-size records throughout.
+  size_t smallRecordBytes = 0;
+  // Connections the kernel queues for accept before it refuses more.
+  int acceptBacklog = 511;
+  // How long a connection may wait for its next request; 0 turns keep-alive
+  // off.
+  chrono::steady_clock::duration keepAliveTimeout = chrono::seconds(5);
+  // How long a client may take to send a request head, counted from the
+  // connection or from the first byte of the head; 0 means no limit.
+  chrono::steady_clock::duration headerTimeout = chrono::seconds(10);
+  // How long writing a response may make no progress; 0 means no limit.
+  chrono::steady_clock::duration sendTimeout = chrono::seconds(60);
+  // Requests served on one connection before it is closed; 0 means no limit.
+  unsigned maxRequests = 100;
+  // The content pack served instead of dir, if any. Loading a new one
+  // replaces it with atomic_store while sessions may atomic_load it.
+  shared_ptr<const Pack::Archive> pack;
+};
+
+// Inserted after the other headers of every response, depending on whether
+// the connection persists and which protocol version the client speaks.
+static const string connectionClose = "Connection: close\r\n";
+static const string connectionKeepAlive = "Connection: keep-alive\r\n";
+static const string connectionDefault = "";
+
+// A resumable HTTP/1.x request head parser. It runs over the receive buffer
+// in place, keeping where it stopped so that bytes arriving in later reads
+// are scanned only once, and yields the request line and header fields as
+// views into the buffer without allocating. The buffer must stay in place
+// until the parser is reset.
+class RequestParser {
+public:
+  enum class Status {
+    Incomplete,
+    Complete,
+    Invalid,
+  };
+
+  struct Header {
+    StringRef name;
+    StringRef value;
+  };
+
+  static const size_t max_headers = 64;
+
+  explicit RequestParser(size_t maxLength) : maxLength_{maxLength} {}
+
+  void reset() {
+    state_ = State::MethodStart;
+    pos_ = 0;
+    headerCount_ = 0;
+    method_ = target_ = version_ = StringRef();
+  }
+
+  // Continues parsing the first size bytes of buffer, of which all but the
+  // ones appended since the last call have been seen already.
+  Status parse(const char *buffer, size_t size) {
+    for (; pos_ < size; ++pos_) {
+      const char c = buffer[pos_];
+      switch (state_) {
+      case State::MethodStart:
+        // Empty lines before a request are tolerated.
+        if (c == '\r' || c == '\n')
+          break;
+        if (!isToken(c))
+          return Status::Invalid;
+        mark_ = pos_;
+        state_ = State::Method;
+        break;
+      case State::Method:
+        if (c == ' ') {
+          method_ = StringRef(buffer + mark_, pos_ - mark_);
+          mark_ = pos_ + 1;
+          state_ = State::Target;
+        } else if (!isToken(c)) {
+          return Status::Invalid;
+        }
+        break;
+      case State::Target:
+        if (c == ' ') {
+          if (pos_ == mark_)
+            return Status::Invalid;
+          target_ = StringRef(buffer + mark_, pos_ - mark_);
+          mark_ = pos_ + 1;
+          state_ = State::Version;
+        } else if (!isVisible(c)) {
+          return Status::Invalid;
+        }
+        break;
+      case State::Version:
+        if (c == '\r' || c == '\n') {
+          version_ = StringRef(buffer + mark_, pos_ - mark_);
+          if (version_.size != 8 || memcmp(version_.data, "HTTP/1.", 7) != 0 ||
+              !isdigit(static_cast<unsigned char>(version_.data[7])))
+            return Status::Invalid;
+          state_ = c == '\r' ? State::RequestLineEnd : State::HeaderStart;
+        } else if (!isVisible(c)) {
+          return Status::Invalid;
+        }
+        break;
+      case State::RequestLineEnd:
+      case State::HeaderLineEnd:
+        if (c != '\n')
+          return Status::Invalid;
+        state_ = State::HeaderStart;
+        break;
+      case State::HeaderStart:
+        if (c == '\r') {
+          state_ = State::HeadEnd;
+        } else if (c == '\n') {
+          ++pos_;
+          return Status::Complete;
+        } else if (isToken(c)) {
+          if (headerCount_ == max_headers)
+            return Status::Invalid;
+          mark_ = pos_;
+          state_ = State::HeaderName;
+        } else {
+          return Status::Invalid;
+        }
+        break;
+      case State::HeaderName:
+        if (c == ':') {
+          headers_[headerCount_].name = StringRef(buffer + mark_, pos_ - mark_);
+          state_ = State::HeaderValueStart;
+        } else if (!isToken(c)) {
+          return Status::Invalid;
+        }
+        break;
+      case State::HeaderValueStart:
+        if (c == ' ' || c == '\t')
+          break;
+        mark_ = pos_;
+        valueEnd_ = pos_;
+        state_ = State::HeaderValue;
+        // fall through
+      case State::HeaderValue:
+        if (c == '\r' || c == '\n') {
+          headers_[headerCount_++].value =
+              StringRef(buffer + mark_, valueEnd_ - mark_);
+          state_ = c == '\r' ? State::HeaderLineEnd : State::HeaderStart;
+        } else if (c == ' ' || c == '\t') {
+          // Trailing whitespace is not part of the value.
+        } else if (static_cast<unsigned char>(c) < 0x20 || c == 0x7f) {
+          return Status::Invalid;
+        } else {
+          valueEnd_ = pos_ + 1;
+        }
+        break;
+      case State::HeadEnd:
+        if (c != '\n')
+          return Status::Invalid;
+        ++pos_;
+        return Status::Complete;
+      }
+    }
+    return pos_ >= maxLength_ ? Status::Invalid : Status::Incomplete;
+  }
+
+  // Bytes of the buffer taken by the complete request head.
+  size_t length() const { return pos_; }
+
+  StringRef method() const { return method_; }
+  StringRef target() const { return target_; }
+  StringRef version() const { return version_; }
+
+  const Header *begin() const { return headers_; }
+  const Header *end() const { return headers_ + headerCount_; }
+
+private:
+  enum class State {
+    MethodStart,
+    Method,
+    Target,
+    Version,
+    RequestLineEnd,
+    HeaderStart,
+    HeaderName,
+    HeaderValueStart,
+    HeaderValue,
+    HeaderLineEnd,
+    HeadEnd,
+  };
+
+  static bool isToken(char c) {
+    return isalnum(static_cast<unsigned char>(c)) ||
+           (c && strchr("!#$%&'*+-.^_`|~", c));
+  }
+
+  static bool isVisible(char c) { return c > 0x20 && c < 0x7f; }
+
+  size_t maxLength_;
+  State state_ = State::MethodStart;
+  size_t pos_ = 0;
+  size_t mark_ = 0;
+  size_t valueEnd_ = 0;
+  StringRef method_;
+  StringRef target_;
+  StringRef version_;
+  Header headers_[max_headers];
+  size_t headerCount_ = 0;
+};
+
+// A byte range of a file, both ends inclusive.
+struct ByteRange {
+  uint64_t first;
+  uint64_t last;
+};
+
+static const size_t max_ranges = 16;
+
+// Parses a Range header value for a file of the given size into the ranges
+// that can be satisfied. Returns false if the header is to be ignored because
+// it is malformed, is not in bytes or asks for too many ranges.
+static bool parseRanges(StringRef value, uint64_t size,
+                        vector<ByteRange> &ranges) {
+  ranges.clear();
+  const char *p = value.data;
+  const char *end = value.data + value.size;
+  if (value.size < 6 || memcmp(p, "bytes=", 6) != 0)
+    return false;
+  p += 6;
+
+  auto number = [&](uint64_t &n) {
+    const char *start = p;
+    n = 0;
+    for (; p < end && isdigit(static_cast<unsigned char>(*p)); ++p) {
+      if (n > (numeric_limits<uint64_t>::max() - 9) / 10)
+        return false;
+      n = n * 10 + (*p - '0');
+    }
+    return p != start;
+  };
+  auto skipSpaces = [&] {
+    while (p < end && (*p == ' ' || *p == '\t'))
+      ++p;
+  };
+
+  size_t specs = 0;
+  for (;;) {
+    skipSpaces();
+    if (++specs > max_ranges)
+      return false;
+    uint64_t first = 0;
+    uint64_t last = 0;
+    if (p < end && *p == '-') {
+      // A suffix: the last n bytes.
+      ++p;
+      if (!number(last))
+        return false;
+      if (last > 0 && size > 0)
+        ranges.push_back(ByteRange{size - min(last, size), size - 1});
+    } else {
+      if (!number(first) || p == end || *p++ != '-')
+        return false;
+      bool open = !number(last);
+      if (open)
+        last = size - 1;
+      if (!open && last < first)
+        return false;
+      if (first < size)
+        ranges.push_back(ByteRange{first, min(last, size - 1)});
+    }
+    skipSpaces();
+    if (p == end)
+      return true;
+    if (*p++ != ',')
+      return false;
+  }
+}
+
+// Separates the parts of multipart/byteranges responses.
+static const char rangeBoundary[] = "7b3c42e1d09f5a68";
+
+class Session;
+
+// The live sessions of a server, for a drain to reach the idle ones. Shared
+// by the server with its sessions, since a session may outlive the server:
+// those still queued in the io_service when the server stops are only
+// destroyed with it, and they leave the set on their way out.
+class SessionSet {
+public:
+  void insert(Session *session, weak_ptr<Session> ref) {
+    lock_guard<mutex> lock(mutex_);
+    sessions_.emplace(session, move(ref));
+  }
+
+  void erase(Session *session) {
+    lock_guard<mutex> lock(mutex_);
+    sessions_.erase(session);
+  }
+
+  size_t size() const {
+    lock_guard<mutex> lock(mutex_);
+    return sessions_.size();
+  }
+
+  // Calls f on every session still alive, outside the lock.
+  template <typename F> void forEach(F f) const {
+    vector<shared_ptr<Session>> alive;
+    {
+      lock_guard<mutex> lock(mutex_);
+      for (const auto &s : sessions_)
+        if (auto session = s.second.lock())
+          alive.push_back(move(session));
+    }
+    for (auto &session : alive)
+      f(*session);
+  }
+
+private:
+  mutable mutex mutex_;
+  unordered_map<Session *, weak_ptr<Session>> sessions_;
+};
+
+class Session : public enable_shared_from_this<Session> {
+public:
+  static const int max_length = 8192;
+  static const size_t chunk_size = 64 * 1024;
+
+  Session(tcp::socket socket, Context &context,
+          shared_ptr<SessionSet> sessions, bool admin, bool tls = false)
+      : socket_{move(socket)}, context_(context), sessions_{move(sessions)},
+        strand_{socket_.get_io_service()}, timer_{socket_.get_io_service()},
+        parser_{max_length}, admin_{admin} {
+    if (tls) {
+      tls_.reset(new TlsStream(socket_, context_.tls->context()));
+      tls_->set_handshake_pool(context_.handshakePool);
+    }
+    context_.metrics.sessionOpened(tls);
+  }
+
+  ~Session() {
+    sessions_->erase(this);
+    context_.metrics.sessionClosed(tls_ != nullptr);
+  }
+
+  void start() {
+    sessions_->insert(this, shared_from_this());
+    expireIn(context_.headerTimeout, Timeout::Header);
+    if (tls_) {
+      // A response goes out as several records, and Nagle would hold back
+      // all but the first until the client acknowledged it.
+      asio::error_code ignored_ec;
+      socket_.set_option(tcp::no_delay(true), ignored_ec);
+      handshake();
+    } else {
+      doRead();
+    }
+  }
+
+  // Takes over a connection a predecessor had kept alive.
+  void resume() {
+    sessions_->insert(this, shared_from_this());
+    expireIn(context_.keepAliveTimeout, Timeout::Idle);
+    doRead();
+  }
+
+  // Sends the connection to the successor if it waits for its next request.
+  // The others follow once they have answered the request at hand.
+  void handOff() {
+    auto self(shared_from_this());
+    strand_.post([this, self] {
+      if (phase_ == Timeout::Idle && socket_.is_open())
+        passOn();
+    });
+  }
+
+  // Turns the request target into the path of the file asked for.
+  static Result requestPath(StringRef uri, string &request_path) {
+    const char *query =
+        static_cast<const char *>(memchr(uri.data, '?', uri.size));
+    if (query) {
+      uri.size = query - uri.data;
+    }
+
+    // Decode url to path.
+    if (!urlDecode(uri.data, uri.size, request_path)) {
+      return Result::BadRequest;
+    }
+
+    // Request path must be absolute and not contain "..".
+    if (request_path.empty() || request_path[0] != '/' ||
+        request_path.find("..") != string::npos) {
+      return Result::BadRequest;
+    }
+
+    // If path ends in slash (i.e. is a directory) then add "index.html".
+    if (request_path[request_path.size() - 1] == '/') {
+      request_path += "index.html";
+    }
+    return Result::Ok;
+  }
+
+  // Looks the request up. The paths are built in strings kept from one
+  // request to the next, so that serving a cached response allocates
+  // nothing once they have grown to size.
+  Result handleRequest(StringRef uri, shared_ptr<const File> &file,
+                       shared_ptr<const string> &cached,
+                       Representation &rep) {
+    string &request_path = requestPath_;
+    Result result = requestPath(uri, request_path);
+    if (result != Result::Ok) {
+      return result;
+    }
+
+    string &full_path = fullPath_;
+    full_path.assign(context_.dir).append(request_path);
+    file = context_.files.find(full_path);
+    if (!file) {
+      return Result::NotFound;
+    }
+    rep = Representation();
+    rep.stamp = file->stamp();
+    rep.type = mimeType(request_path);
+
+    // Pick the most preferred precompressed coding that the client takes.
+    SidecarCache::Sidecars sidecars =
+        context_.sidecars.find(full_path, rep.stamp);
+    unsigned available = sidecars.encodings;
+    rep.vary = available != bitOf(Encoding::Identity);
+    unsigned accepted = acceptedEncodings(acceptEncoding_);
+    rep.encoding = preferredEncoding(available & accepted);
+    const char *suffix = encodingSuffixes[static_cast<int>(rep.encoding)];
+
+    // Without a gzip sidecar, a compressible file is gzipped on the side
+    // and sent as it is until that is done.
+    shared_ptr<const string> gzipped;
+    Compressor &compressor = context_.compressor;
+    if (!(available & bitOf(Encoding::Gzip)) && compressor.accepts(rep)) {
+      rep.vary = true;
+      if (rep.encoding == Encoding::Identity && range_.empty() &&
+          (accepted & bitOf(Encoding::Gzip))) {
+        Representation gzip = rep;
+        gzip.encoding = Encoding::Gzip;
+        gzipped = compressor.find(full_path, gzip);
+        if (gzipped)
+          rep = gzip;
+      }
+    }
+
+    // A client that already has the current version gets no body at all.
+    if (notModified(rep)) {
+      return Result::NotModified;
+    }
+    if (gzipped) {
+      cached = move(gzipped);
+      return Result::Ok;
+    }
+
+    // Serve a cached response if the file has not changed since. Range
+    // requests are served from the file itself.
+    ResponseCache &cache = context_.cache;
+    if (cache.enabled() && range_.empty()) {
+      const FileStamp &body = sidecars.stamps[static_cast<int>(rep.encoding)];
+      cached = cache.find(request_path, rep.encoding, rep.stamp, body);
+      if (cached) {
+        return Result::Ok;
+      }
+    }
+
+    // The body is streamed from the file, or from its sidecar. Should the
+    // sidecar have gone, the file itself is sent instead.
+    if (rep.encoding != Encoding::Identity) {
+      auto sidecar = context_.files.find(full_path + suffix);
+      if (sidecar) {
+        file = move(sidecar);
+      } else {
+        rep.encoding = Encoding::Identity;
+      }
+    }
+
+    // Small files are rendered once into a complete response and cached.
+    if (cache.enabled() && range_.empty() && cache.accepts(file->size())) {
+      string header = headerFor(rep, file->size());
+      auto response = make_shared<string>(header);
+      if (file->readAll(*response, header.size())) {
+        cache.insert(request_path, rep.encoding, rep.stamp, file->stamp(),
+                     response);
+        cached = move(response);
+        file.reset();
+      }
+    }
+    return Result::Ok;
+  }
+
+  // Evaluates If-None-Match, or If-Modified-Since in its absence, against the
+  // current version of the file.
+  bool notModified(const Representation &rep) const {
+    if (!ifNoneMatch_.empty()) {
+      if (ifNoneMatch_ == "*")
+        return true;
+      // Weak comparison: a W/ prefix on the client's tag is ignored.
+      string etag = rep.etag();
+      const char *p = ifNoneMatch_.data;
+      const char *end = p + ifNoneMatch_.size;
+      while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+          ++p;
+        if (end - p > 2 && p[0] == 'W' && p[1] == '/')
+          p += 2;
+        const char *tagEnd = p < end && *p == '"'
+                                 ? static_cast<const char *>(
+                                       memchr(p + 1, '"', end - p - 1))
+                                 : nullptr;
+        if (!tagEnd)
+          return false;
+        if (StringRef(p, tagEnd + 1 - p) == etag.c_str())
+          return true;
+        p = tagEnd + 1;
+      }
+      return false;
+    }
+    if (!ifModifiedSince_.empty()) {
+      struct tm tm;
+      memset(&tm, 0, sizeof(tm));
+      string date = ifModifiedSince_.str();
+      const char *end = strptime(date.c_str(), "%a, %d %b %Y %H:%M:%S", &tm);
+      return end && rep.stamp.mtime <= timegm(&tm);
+    }
+    return false;
+  }
+
+private:
+  typedef asio::ssl::stream<tcp::socket &> TlsStream;
+
+  // A piece of a response body: some text followed by a range of the file.
+  struct Segment {
+    string text;
+    off_t offset;
+    uint64_t length;
+  };
+
+  // Gives the connection until timeout from now to get past its current
+  // phase. Postponing the deadline costs nothing, as the timer only catches
+  // up with it once it fires; only an earlier deadline moves the timer.
+  void expireIn(chrono::steady_clock::duration timeout, Timeout phase) {
+    phase_ = phase;
+    if (timeout == chrono::steady_clock::duration::zero()) {
+      deadline_ = chrono::steady_clock::time_point::max();
+      return;
+    }
+    deadline_ = chrono::steady_clock::now() + timeout;
+    if (!timerArmed_ || deadline_ < timer_.expires_at())
+      armTimer();
+  }
+
+  // Closes the connection once the deadline has passed. The count of such
+  // closures is kept per phase.
+  void armTimer() {
+    timerArmed_ = true;
+    timer_.expires_at(deadline_);
+    auto self(shared_from_this());
+    timer_.async_wait(strand_.wrap([this, self](asio::error_code error) {
+      if (error)
+        return; // Replaced by a nearer deadline, or shut down.
+      if (deadline_ == chrono::steady_clock::time_point::max()) {
+        timerArmed_ = false;
+      } else if (deadline_ <= chrono::steady_clock::now()) {
+        timerArmed_ = false;
+        context_.metrics.timedOut(phase_);
+        close();
+      } else {
+        armTimer();
+      }
+    }));
+  }
+
+  // The completion condition of response writes, which moves the deadline
+  // on whenever some more of the response went out.
+  struct Progress {
+    size_t operator()(const asio::error_code &error, size_t) const {
+      session->madeProgress();
+      return error ? 0 : 65536;
+    }
+    Session *session;
+  };
+
+  void madeProgress() {
+    if (context_.sendTimeout != chrono::steady_clock::duration::zero())
+      deadline_ = chrono::steady_clock::now() + context_.sendTimeout;
+  }
+
+  // Runs the TLS handshake, within the header deadline, and counts whether
+  // the client resumed a session. Afterwards the kernel is given the keys of
+  // the traffic sent where it can take them, so that responses are written
+  // to the socket as they are and files go out with sendfile again.
+  void handshake() {
+    auto self(shared_from_this());
+    tls_->async_handshake(
+        asio::ssl::stream_base::server,
+        strand_.wrap([this, self](asio::error_code error) {
+          if (error) {
+            context_.metrics.handshake(Handshake::Failed);
+            shutdown();
+            return;
+          }
+          context_.metrics.handshake(SSL_session_reused(tls_->native_handle())
+                                         ? Handshake::Resumed
+                                         : Handshake::Full);
+          if (!tls_->set_kernel_send(error))
+            context_.metrics.kernelTls();
+          else
+            tls_->set_dynamic_record_sizing(context_.smallRecordBytes);
+          doRead();
+        }));
+  }
+
+  // Reads more of the next request. The idle deadline of a kept-alive
+  // connection gives way to the header deadline with the first byte.
+  //
+  // The read is done here with recvmsg once the reactor reports the socket
+  // readable, rather than by the reactor itself. That way no data leaves the
+  // kernel outside the strand, so an idle connection can be handed to a
+  // successor at any time, and the kernel tells when it received the data,
+  // so that admission can tell how long the request waited. Over TLS the
+  // stream reads and decrypts instead.
+  void doRead() {
+    if (tls_) {
+      readTls();
+      return;
+    }
+    asio::error_code error;
+    if (!socket_.native_non_blocking())
+      socket_.native_non_blocking(true, error);
+    while (!error) {
+      iovec iov{data_ + size_, max_length - size_};
+      char control[CMSG_SPACE(sizeof(timespec))];
+      msghdr message{};
+      message.msg_iov = &iov;
+      message.msg_iovlen = 1;
+      message.msg_control = control;
+      message.msg_controllen = sizeof(control);
+      ssize_t n = ::recvmsg(socket_.native_handle(), &message, 0);
+      if (n > 0) {
+#ifdef SCM_TIMESTAMPNS
+        for (cmsghdr *c = CMSG_FIRSTHDR(&message); c;
+             c = CMSG_NXTHDR(&message, c)) {
+          if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_TIMESTAMPNS)
+            continue;
+          timespec when;
+          memcpy(&when, CMSG_DATA(c), sizeof(when));
+          received_ = when.tv_sec * 1000000000ll + when.tv_nsec;
+        }
 #endif
+        if (phase_ == Timeout::Idle)
+          expireIn(context_.headerTimeout, Timeout::Header);
+        size_ += n;
+        processRequest();
+        return;
+      }
+      if (n == 0)
+        break;
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        auto self(shared_from_this());
+        socket_.async_read_some(
+            asio::null_buffers(),
+            strand_.wrap([this, self](asio::error_code error, size_t) {
+              if (error)
+                shutdown();
+              else
+                doRead();
+            }));
+        return;
+      }
+      error = asio::error_code(errno, asio::error::get_system_category());
+      cerr << "Session exception: " << error.message() << "\n";
+    }
+    shutdown();
+  }
 
-///////////////////////////////////////////////////////////////////////////////
-// final -h <ip> -p <port> -d <directory>
-///////////////////////////////////////////////////////////////////////////////
-
-using namespace std;
-using asio::ip::tcp;
+  void readTls() {
+    auto self(shared_from_this());
+    tls_->async_read_some(
+        asio::buffer(data_ + size_, max_length - size_),
+        strand_.wrap([this, self](asio::error_code error, size_t length) {
+          if (error) {
+            shutdown();
+            return;
+          }
+          if (phase_ == Timeout::Idle)
+            expireIn(context_.headerTimeout, Timeout::Header);
+          size_ += length;
+          processRequest();
+        }));
+  }
 
-static ofstream *log_;
+  // Writes buffers completely, through TLS if the connection has it.
+  template <typename Buffers, typename Handler>
+  void writeBuffers(const Buffers &buffers, Handler handler) {
+    if (tls_)
+      asio::async_write(*tls_, buffers, Progress{this}, handler);
+    else
+      asio::async_write(socket_, buffers, Progress{this}, handler);
+  }
 
-namespace HttpServer {
+  // Answers the first complete request in the buffer, or reads until there is
+  // one. Pipelined requests are answered one after another in order.
+  void processRequest() {
+    switch (parser_.parse(data_, size_)) {
+    case RequestParser::Status::Incomplete:
+      doRead();
+      break;
+    case RequestParser::Status::Complete:
+      beginRequest();
+      requestLength_ = parser_.length();
+      reply(admitted() ? run() : Result::Unavailable);
+      break;
+    case RequestParser::Status::Invalid:
+      beginRequest();
+      keepAlive_ = false;
+      reply(Result::BadRequest);
+      break;
+    }
+  }
 
-static const string notFoundContent = "<html>"
-                                      "<head><title>Not Found</title></head>"
-                                      "<body><h1>404 Not Found</h1></body>"
-                                      "</html>";
+  // Whether the request is to be served, given how long it waited since
+  // the kernel received it. Its wait is unknown without receive timestamps.
+  bool admitted() {
+    if (!context_.admission.enabled() || received_ == 0)
+      return true;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    int64_t wait = now.tv_sec * 1000000000ll + now.tv_nsec - received_;
+    return context_.admission.admit(chrono::nanoseconds(max<int64_t>(wait, 0)));
+  }
 
-static const string notFound = "HTTP/1.0 404 Not Found\r\nContent-Length: " +
-                               to_string(notFoundContent.size()) +
-                               "\r\nContent-Type: text/html\r\n\r\n" +
-                               notFoundContent;
+  Result run() {
+    // HTTP/1.1 connections persist unless closed explicitly, HTTP/1.0 ones
+    // only when the client asks for it. A request carrying a body is never
+    // followed by another one, as the body is not read.
+    ++requests_;
+    http10_ = parser_.version() != "HTTP/1.1";
+    keepAlive_ = !http10_;
+    range_ = ifRange_ = ifNoneMatch_ = ifModifiedSince_ = acceptEncoding_ =
+        StringRef();
+    for (const auto &header : parser_) {
+      if (header.name.iequals("accept-encoding")) {
+        acceptEncoding_ = header.value;
+      } else if (header.name.iequals("if-none-match")) {
+        ifNoneMatch_ = header.value;
+      } else if (header.name.iequals("if-modified-since")) {
+        ifModifiedSince_ = header.value;
+      } else if (header.name.iequals("range")) {
+        range_ = header.value;
+      } else if (header.name.iequals("if-range")) {
+        ifRange_ = header.value;
+      } else if (header.name.iequals("connection")) {
+        if (header.value.hasToken("close"))
+          keepAlive_ = false;
+        else if (header.value.hasToken("keep-alive"))
+          keepAlive_ = true;
+      } else if (header.name.iequals("transfer-encoding") ||
+                 (header.name.iequals("content-length") &&
+                  header.value != "0")) {
+        keepAlive_ = false;
+      }
+    }
+    if ((context_.maxRequests && requests_ >= context_.maxRequests) ||
+        context_.keepAliveTimeout == chrono::steady_clock::duration::zero())
+      keepAlive_ = false;
+
+    if (parser_.method() == "GET") {
+      if (admin_)
+        return handleAdminRequest(parser_.target());
+      pack_ = atomic_load(&context_.pack);
+      if (pack_)
+        return handlePackedRequest(parser_.target());
+      return handleRequest(parser_.target(), file_, cached_, rep_);
+    }
+    keepAlive_ = false;
+    return Result::BadRequest;
+  }
 
-static const string badRequestContent =
-    "<html>"
-    "<head><title>Bad Request</title></head>"
-    "<body><h1>400 Bad Request</h1></body>"
-    "</html>";
+  // The admin port serves nothing but the metrics.
+  Result handleAdminRequest(StringRef target) {
+    if (target != "/metrics")
+      return Result::NotFound;
+    string body = context_.metrics.render();
+    cached_ = make_shared<string>(
+        "HTTP/1.1 200 OK\r\nContent-Length: " + to_string(body.size()) +
+        "\r\nContent-Type: text/plain; version=0.0.4\r\n\r\n" + body);
+    return Result::Ok;
+  }
 
-static const string badRequest =
-    "HTTP/1.0 400 Bad Request\r\nContent-Length: " +
-    to_string(badRequestContent.size()) +
-    "\r\nContent-Type: text/html\r\n\r\n" + badRequestContent;
+  // Answers from pack_ with no system call. The response, or for a range
+  // request the body, is a view of the mapped pack.
+  Result handlePackedRequest(StringRef uri) {
+    string &request_path = requestPath_;
+    Result result = requestPath(uri, request_path);
+    if (result != Result::Ok)
+      return result;
+    const Pack::Entry *entry =
+        pack_->find(request_path.data(), request_path.size());
+    if (!entry)
+      return Result::NotFound;
 
-enum class Result {
-  Ok,
-  NotFound,
-  BadRequest,
-  Error,
-};
+    unsigned available = 0;
+    for (size_t i = 0; i < encoding_count; ++i)
+      if (entry->variants[i].headLength)
+        available |= 1u << i;
+    rep_ = Representation();
+    rep_.stamp = pack_->stamp(*entry);
+    rep_.type = mimeType(request_path);
+    rep_.vary = available != bitOf(Encoding::Identity);
+    rep_.encoding =
+        preferredEncoding(available & acceptedEncodings(acceptEncoding_));
+    if (notModified(rep_))
+      return Result::NotModified;
+
+    const Pack::Variant &variant =
+        entry->variants[static_cast<int>(rep_.encoding)];
+    const char *response = pack_->data() + variant.offset;
+    if (range_.empty())
+      packed_ = StringRef(response, variant.headLength + variant.bodyLength);
+    else
+      packedBody_ = StringRef(response + variant.headLength,
+                              variant.bodyLength);
+    return Result::Ok;
+  }
 
-class Session : public enable_shared_from_this<Session> {
-public:
-  static const int max_length = 1024;
+  void beginRequest() {
+    inRequest_ = true;
+    requestStart_ = chrono::steady_clock::now();
+    bytes_ = 0;
+  }
 
-  explicit Session(tcp::socket socket, string dir)
-      : socket_{move(socket)}, dir_{dir} {}
+  // Accounts for the request just answered, or abandoned if the response
+  // could not be sent completely.
+  void endRequest(bool completed) {
+    if (!inRequest_)
+      return;
+    inRequest_ = false;
+    Result result = completed ? result_ : Result::Error;
+    uint32_t latency = chrono::duration_cast<chrono::microseconds>(
+                           chrono::steady_clock::now() - requestStart_)
+                           .count();
+    context_.metrics.request(result, bytes_, latency);
+    if (!log_)
+      return;
+    LogRecord record;
+    record.kind = LogRecord::Kind::Access;
+    record.status =
+        !completed ? 0 : !ranges_.empty() ? 206 : statusOf(result);
+    record.bytes = bytes_;
+    record.latency = latency;
+    StringRef method = parser_.method();
+    StringRef target = parser_.target();
+    LogRecord::copy(record.method, sizeof(record.method), method.data,
+                    method.size);
+    LogRecord::copy(record.text, sizeof(record.text), target.data,
+                    target.size);
+    log_->push(record);
+  }
 
-  void operator()() {
-    string content;
-    Result r = run(content);
+  static int statusOf(Result r) {
+    switch (r) {
+    case Result::Ok:
+      return 200;
+    case Result::NotFound:
+      return 404;
+    case Result::BadRequest:
+      return 400;
+    case Result::RangeNotSatisfiable:
+      return 416;
+    case Result::NotModified:
+      return 304;
+    case Result::Unavailable:
+      return 503;
+    default:
+      return 0;
+    }
+  }
 
+  void reply(Result r) {
+    result_ = r;
     switch (r) {
     case Result::Ok: {
-      stringstream resp;
-      resp << "HTTP/1.0 200 OK\r\nContent-Length: " << content.size()
-           << "\r\nContent-type: text/html\r\n\r\n"
-           << content;
-      write(socket_, asio::buffer(resp.str()));
+      if (cached_) {
+        write(*cached_, false);
+        break;
+      }
+      if (!packed_.empty()) {
+        write(packed_, false);
+        break;
+      }
+      prepareBody();
+      write(response_, true);
     } break;
-    case Result::NotFound:
-      write(socket_, asio::buffer(notFound));
+    case Result::NotModified:
+      response_ = "HTTP/1.1 304 Not Modified\r\n" + rep_.headers() + "\r\n";
+      write(response_, false);
       break;
-    case Result::Error:
+    case Result::NotFound:
+      write(notFound, false);
       break;
     case Result::BadRequest:
-      write(socket_, asio::buffer(badRequest));
+      keepAlive_ = false;
+      write(badRequest, false);
       break;
+    case Result::Unavailable:
+      keepAlive_ = false;
+      write(serviceUnavailable, false);
+      break;
+    case Result::Error:
     default:
+      shutdown();
       break;
     }
+  }
 
-    asio::error_code ignored_ec;
-    socket_.shutdown(tcp::socket::shutdown_both, ignored_ec);
+  // Writes a complete response, adding a Connection header after the others
+  // when the client has to be told whether the connection persists.
+  void write(const string &response, bool thenFile) {
+    write(StringRef(response.data(), response.size()), thenFile);
   }
 
-  Result handleRequest(string uri, string &content) const {
-    int p = uri.find('?');
-    if (p != string::npos) {
-      uri = uri.substr(0, p);
+  void write(StringRef response, bool thenFile) {
+    // A response without a complete head, say from a damaged pack, is not
+    // sent at all.
+    const char *blank = static_cast<const char *>(
+        memmem(response.data, response.size, "\r\n\r\n", 4));
+    if (!blank) {
+      shutdown();
+      return;
+    }
+    size_t split = blank - response.data + 2;
+    const string &connection =
+        !keepAlive_ ? connectionClose
+                    : (http10_ ? connectionKeepAlive : connectionDefault);
+    array<asio::const_buffer, 3> buffers = {
+        {asio::buffer(response.data, split), asio::buffer(connection),
+         asio::buffer(response.data + split, response.size - split)}};
+
+    expireIn(context_.sendTimeout, Timeout::Send);
+
+    // The head of a packed body goes out in the same write as the start of
+    // the body, which over TLS makes them one record.
+    if (thenFile && mapping_ && !segments_.empty() &&
+        segments_[0].length > 0) {
+      head_ = buffers;
+      sendBody();
+      return;
     }
 
-    // Decode url to path.
-    string request_path;
-    if (!urlDecode(uri, request_path)) {
-      return Result::BadRequest;
+    auto self(shared_from_this());
+    writeBuffers(
+        buffers,
+        strand_.wrap([this, self, thenFile](asio::error_code error,
+                                            size_t length) {
+          bytes_ += length;
+          if (error)
+            shutdown();
+          else if (thenFile)
+            sendBody();
+          else
+            finish();
+        }));
+  }
+
+  // A range is used only if the client's copy, named by If-Range, is still
+  // the current one. Weak validators never match.
+  bool ifRangeMatches() const {
+    if (ifRange_.empty())
+      return true;
+    if (ifRange_.data[0] == '"')
+      return ifRange_ == rep_.etag().c_str();
+    return ifRange_ == rep_.stamp.lastModified().c_str();
+  }
+
+  // Prepares the head and the body segments for file_, or the packed body:
+  // the whole of it, one range of it, or several ranges as
+  // multipart/byteranges.
+  void prepareBody() {
+    uint64_t size = packedBody_.size;
+    mapping_ = packedBody_.data;
+    if (file_) {
+      size = file_->size();
+      mapping_ = nullptr;
+    }
+    segments_.clear();
+    segment_ = 0;
+    ranges_.clear();
+    if (range_.empty() || !ifRangeMatches() ||
+        !parseRanges(range_, size, ranges_)) {
+      ranges_.clear();
+      response_ = headerFor(rep_, size);
+      segments_.push_back(Segment{string(), 0, size});
+      return;
     }
 
-    // Request path must be absolute and not contain "..".
-    if (request_path.empty() || request_path[0] != '/' ||
-        request_path.find("..") != string::npos) {
-      return Result::BadRequest;
+    stringstream resp;
+    if (ranges_.empty()) {
+      result_ = Result::RangeNotSatisfiable;
+      resp << "HTTP/1.1 416 Range Not Satisfiable\r\nContent-Range: bytes */"
+           << size << "\r\nContent-Length: 0\r\n\r\n";
+      response_ = resp.str();
+      return;
     }
 
-    // If path ends in slash (i.e. is a directory) then add "index.html".
-    if (request_path[request_path.size() - 1] == '/') {
-      request_path += "index.html";
+    uint64_t length = 0;
+    if (ranges_.size() == 1) {
+      const ByteRange &r = ranges_[0];
+      length = r.last - r.first + 1;
+      segments_.push_back(
+          Segment{string(), static_cast<off_t>(r.first), length});
+      resp << "HTTP/1.1 206 Partial Content\r\nContent-Length: " << length
+           << "\r\nContent-type: " << rep_.type->name
+           << "\r\nContent-Range: bytes " << r.first << "-" << r.last << "/"
+           << size;
+    } else {
+      for (const auto &r : ranges_) {
+        stringstream part;
+        part << (segments_.empty() ? "--" : "\r\n--") << rangeBoundary
+             << "\r\nContent-type: " << rep_.type->name
+             << "\r\nContent-Range: bytes " << r.first << "-" << r.last
+             << "/" << size << "\r\n\r\n";
+        segments_.push_back(Segment{part.str(), static_cast<off_t>(r.first),
+                                    r.last - r.first + 1});
+        length += segments_.back().text.size() + segments_.back().length;
+      }
+      segments_.push_back(
+          Segment{string("\r\n--") + rangeBoundary + "--\r\n", 0, 0});
+      length += segments_.back().text.size();
+      resp << "HTTP/1.1 206 Partial Content\r\nContent-Length: " << length
+           << "\r\nContent-Type: multipart/byteranges; boundary="
+           << rangeBoundary;
     }
+    resp << "\r\n" << rep_.headers() << "\r\n";
+    response_ = resp.str();
+  }
 
-    // Open the file to send back.
-    string full_path = dir_ + request_path;
-    ifstream is(full_path.c_str(), ios::in | ios::binary);
-    if (!is) {
-      return Result::NotFound;
+  // Sends the body segments in order: the text of each one, then its range
+  // of file_ or of the packed body.
+  void sendBody() {
+    while (segment_ < segments_.size()) {
+      Segment &segment = segments_[segment_];
+      if (mapping_ && segment.length > 0) {
+        writeMapped(segment);
+        return;
+      }
+      if (!segment.text.empty()) {
+        auto self(shared_from_this());
+        writeBuffers(asio::buffer(segment.text),
+                     strand_.wrap([this, self](asio::error_code error,
+                                               size_t length) {
+                       bytes_ += length;
+                       segments_[segment_].text.clear();
+                       if (error)
+                         shutdown();
+                       else
+                         sendBody();
+                     }));
+        return;
+      }
+      if (segment.length == 0) {
+        ++segment_;
+        continue;
+      }
+      if (!sendFile(segment))
+        return;
     }
+    finish();
+  }
 
-    // Fill out the reply to be sent to the client.
-    content.clear();
-    char buf[512];
-    while (is.read(buf, sizeof(buf)).gcount() > 0)
-      content.append(buf, is.gcount());
-    return Result::Ok;
+  // Writes the segment's text and its range of the packed body in one go,
+  // with no copy, after the response head if it is still due.
+  void writeMapped(const Segment &segment) {
+    array<asio::const_buffer, 5> buffers = {
+        {head_[0], head_[1], head_[2], asio::buffer(segment.text),
+         asio::buffer(mapping_ + segment.offset, segment.length)}};
+    head_ = {};
+    auto self(shared_from_this());
+    writeBuffers(
+        buffers,
+        strand_.wrap([this, self](asio::error_code error, size_t length) {
+          bytes_ += length;
+          ++segment_;
+          if (error)
+            shutdown();
+          else
+            sendBody();
+        }));
   }
 
-  static bool urlDecode(const string &in, string &out) {
-    out.clear();
-    out.reserve(in.size());
-    for (size_t i = 0; i < in.size(); ++i) {
-      if (in[i] == '%') {
-        if (i + 3 <= in.size()) {
-          int value = 0;
-          istringstream is(in.substr(i + 1, 2));
-          if (is >> hex >> value) {
-            out += static_cast<char>(value);
-            i += 2;
-          } else {
-            return false;
-          }
-        } else {
-          return false;
-        }
-      } else if (in[i] == '+') {
-        out += ' ';
-      } else {
-        out += in[i];
+  // Called once a response is fully written: either closes the connection or
+  // moves on to the next request.
+  void finish() {
+    endRequest(true);
+    if (!keepAlive_) {
+      shutdown();
+      return;
+    }
+    file_.reset();
+    mapping_ = nullptr;
+    cached_.reset();
+    pack_.reset();
+    packed_ = packedBody_ = StringRef();
+    ranges_.clear();
+    size_ -= requestLength_;
+    memmove(data_, data_ + requestLength_, size_);
+    requestLength_ = 0;
+    parser_.reset();
+    if (size_ > 0)
+      expireIn(context_.headerTimeout, Timeout::Header);
+    else
+      expireIn(context_.keepAliveTimeout, Timeout::Idle);
+    if (phase_ == Timeout::Idle && context_.handoff.draining()) {
+      passOn();
+      return;
+    }
+    processRequest();
+  }
+
+  // Closes the connection here once it is queued for the successor, or shuts
+  // it down if it cannot go there, as a TLS connection whose keys are ours
+  // cannot.
+  // Either way the timer goes, so that the session ends as soon as its
+  // pending handlers have run.
+  void passOn() {
+    if (!tls_ && context_.handoff.pass(socket_.native_handle(), admin_))
+      close();
+    shutdown();
+  }
+
+#ifdef __linux__
+  // Copies the segment's range of file_ to the socket inside the kernel.
+  // Whenever the socket buffer is full the reactor is asked to report it
+  // writable again, so a large body costs no user-space copies and no blocked
+  // thread. Returns true once the whole range is sent; otherwise sending
+  // continues asynchronously or the session is shut down.
+  bool sendFile(Segment &segment) {
+    if (tls_ && !tls_->kernel_send())
+      return copyFile(segment);
+    asio::error_code error;
+    if (!socket_.native_non_blocking())
+      socket_.native_non_blocking(true, error);
+    while (!error && segment.length > 0) {
+      ssize_t n = ::sendfile(socket_.native_handle(), file_->fd(),
+                             &segment.offset, segment.length);
+      if (n > 0) {
+        bytes_ += n;
+        segment.length -= n;
+        madeProgress();
+        continue;
+      }
+      if (n == 0)
+        break; // The file was truncated after it was opened.
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        auto self(shared_from_this());
+        socket_.async_write_some(
+            asio::null_buffers(),
+            strand_.wrap([this, self](asio::error_code error, size_t) {
+              if (error)
+                shutdown();
+              else
+                sendBody();
+            }));
+        return false;
       }
+      error = asio::error_code(errno, asio::error::get_system_category());
     }
-    return true;
+    if (!error && segment.length == 0)
+      return true;
+    shutdown();
+    return false;
   }
+#else
+  bool sendFile(Segment &segment) { return copyFile(segment); }
+#endif
 
-  Result run(string &content) {
-    try {
-      char data[max_length];
-      asio::error_code error;
-      size_t length = socket_.read_some(asio::buffer(data, max_length), error);
-      string dataStr(data, length);
+  // Streams the segment's range of file_ through a buffer where the kernel
+  // cannot send it: without sendfile, or over TLS not left to the kernel.
+  bool copyFile(Segment &segment) {
+    chunk_.resize(chunk_size);
+    ssize_t n = pread(file_->fd(), chunk_.data(),
+                      min<uint64_t>(chunk_.size(), segment.length),
+                      segment.offset);
+    if (n <= 0) {
+      shutdown();
+      return false;
+    }
+    segment.offset += n;
+    segment.length -= n;
+    auto self(shared_from_this());
+    writeBuffers(asio::buffer(chunk_.data(), n),
+                 strand_.wrap([this, self](asio::error_code error,
+                                           size_t length) {
+                   bytes_ += length;
+                   if (error)
+                     shutdown();
+                   else
+                     sendBody();
+                 }));
+    return false;
+  }
 
-      if (error == asio::error::eof)
-        return Result::BadRequest;
-      if (error)
-        throw asio::system_error(error);
+  void shutdown() {
+    endRequest(false);
+    // No close_notify is sent, as every response is delimited without it,
+    // but OpenSSL drops the session of a connection not shut down that way
+    // from the cache unless told the shutdown is done.
+    if (tls_)
+      SSL_set_shutdown(tls_->native_handle(),
+                       SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+    asio::error_code ignored_ec;
+    socket_.shutdown(tcp::socket::shutdown_both, ignored_ec);
+    timer_.cancel(ignored_ec);
+    timerArmed_ = false;
+    deadline_ = chrono::steady_clock::time_point::max();
+    file_.reset();
+    mapping_ = nullptr;
+    pack_.reset();
+  }
 
-      if (log_)
-        *log_ << "Data " << dataStr << endl;
+  void close() {
+    asio::error_code ignored_ec;
+    socket_.close(ignored_ec);
+  }
 
-      stringstream ss(dataStr);
-      string method;
-      string path;
-      ss >> method >> path;
+  tcp::socket socket_;
+  unique_ptr<TlsStream> tls_; // Over socket_, for HTTPS connections.
+  Context &context_;
+  shared_ptr<SessionSet> sessions_;
+  asio::io_service::strand strand_;
+  asio::steady_timer timer_;
+  RequestParser parser_;
+  char data_[max_length];
+  size_t size_ = 0;
+  size_t requestLength_ = 0;
+  unsigned requests_ = 0;
+  bool inRequest_ = false;
+  chrono::steady_clock::time_point requestStart_;
+  Result result_ = Result::Ok;
+  uint64_t bytes_ = 0;
+  bool admin_;
+  bool keepAlive_ = false;
+  bool http10_ = true;
+  string response_;
+  string requestPath_; // Decoded, of the request being answered.
+  string fullPath_;    // Of its file.
+  shared_ptr<const string> cached_;
+  shared_ptr<const File> file_;
+  const char *mapping_ = nullptr; // Of the packed body, if one is sent.
+  // The response head, while it waits to go out with the first segment.
+  array<asio::const_buffer, 3> head_;
+  shared_ptr<const Pack::Archive> pack_;
+  chrono::steady_clock::time_point deadline_ =
+      chrono::steady_clock::time_point::max();
+  Timeout phase_ = Timeout::Header;
+  bool timerArmed_ = false;
+  int64_t received_ = 0; // When the kernel received the data last read.
+  StringRef packed_;     // A complete response in pack_.
+  StringRef packedBody_; // A body in pack_ to send ranges of.
+  Representation rep_;
+  StringRef acceptEncoding_;
+  StringRef range_;
+  StringRef ifRange_;
+  StringRef ifNoneMatch_;
+  StringRef ifModifiedSince_;
+  vector<ByteRange> ranges_;
+  vector<Segment> segments_;
+  size_t segment_ = 0;
+  vector<char> chunk_; // For copyFile, allocated on first use.
+};
 
-      if (method == "GET") {
-        return handleRequest(path, content);
+// Accepts connections asynchronously and hands each one to a Session that
+// lives only as long as its pending handlers hold a reference to it.
+class Server {
+public:
+  // Listens on endpoint, or takes over listener, the listening socket of a
+  // predecessor, if it is not -1. Connections to a tls server speak HTTPS.
+  Server(asio::io_service &service, const tcp::endpoint &endpoint,
+         Context &context, bool reusePort, bool admin = false,
+         int listener = -1, bool tls = false)
+      : acceptor_{service}, socket_{service}, retryTimer_{service},
+        context_(context), protocol_{endpoint.protocol()}, admin_{admin},
+        tls_{tls} {
+    if (listener >= 0) {
+      acceptor_.assign(endpoint.protocol(), listener);
+      if (acceptor_.local_endpoint() != endpoint) {
+        ostringstream os;
+        os << "the listener taken over is on " << acceptor_.local_endpoint()
+           << ", not " << endpoint;
+        throw runtime_error(os.str());
       }
-      return Result::BadRequest;
-    } catch (const exception &e) {
-      cerr << "Session exception: " << e.what() << "\n";
-      return Result::Error;
+    } else {
+      acceptor_.open(endpoint.protocol());
+      acceptor_.set_option(tcp::acceptor::reuse_address(true));
+      if (reusePort) {
+#ifdef SO_REUSEPORT
+        acceptor_.set_option(reuse_port(true));
+#else
+        throw asio::system_error(asio::error::operation_not_supported);
+#endif
+      }
+      acceptor_.bind(endpoint);
     }
+#ifdef SO_TIMESTAMPNS
+    if (context_.admission.enabled())
+      acceptor_.set_option(receive_timestamps(true));
+#endif
+    acceptor_.listen(context_.acceptBacklog);
+    doAccept();
+  }
+
+  unsigned long connections() const { return connections_; }
+  int listener() { return acceptor_.native_handle(); }
+  const SessionSet &sessions() const { return *sessions_; }
+
+  // Leaves the listening socket to the successor it was sent to.
+  void stopAccepting() {
+    acceptor_.get_io_service().post([this] {
+      asio::error_code ignored_ec;
+      acceptor_.close(ignored_ec);
+    });
+  }
+
+  // Serves a connection a predecessor kept alive.
+  void adopt(int fd) {
+    asio::io_service &service = acceptor_.get_io_service();
+    service.post([this, fd, &service] {
+      tcp::socket socket(service);
+      asio::error_code error;
+      socket.assign(protocol_, fd, error);
+      if (error) {
+        ::close(fd);
+        return;
+      }
+      ++connections_;
+      make_shared<Session>(move(socket), context_, sessions_, admin_)
+          ->resume();
+    });
+  }
+
+private:
+  // Accepting again at once after an error would spin when the process is
+  // out of descriptors, which is when the CPU is needed to serve and close
+  // the connections it has.
+  static constexpr chrono::milliseconds accept_retry_delay{100};
+
+  void doAccept() {
+    acceptor_.async_accept(socket_, [this](asio::error_code error) {
+      if (!acceptor_.is_open())
+        return; // Left to a successor.
+      if (error) {
+        if (log_)
+          log_->message("Accept " + error.message());
+        retryTimer_.expires_from_now(accept_retry_delay);
+        retryTimer_.async_wait([this](asio::error_code error) {
+          if (!error && acceptor_.is_open())
+            doAccept();
+        });
+        return;
+      }
+      ++connections_;
+      context_.metrics.accepted();
+      make_shared<Session>(move(socket_), context_, sessions_, admin_, tls_)
+          ->start();
+      doAccept();
+    });
   }
 
+  tcp::acceptor acceptor_;
   tcp::socket socket_;
-  string dir_;
+  asio::steady_timer retryTimer_;
+  Context &context_;
+  tcp protocol_;
+  bool admin_;
+  bool tls_;
+  shared_ptr<SessionSet> sessions_ = make_shared<SessionSet>();
+  atomic<unsigned long> connections_{0};
 };
 
-void server(asio::io_service &service, asio::ip::address ip, int port,
-            string dir) {
-  tcp::acceptor a(service, tcp::endpoint(ip, port));
-  for (;;) {
-    tcp::socket sock(service);
-    a.accept(sock);
-    thread(Session(move(sock), dir)).detach();
+constexpr chrono::milliseconds Server::accept_retry_delay;
+
+// An io_service with its own acceptor, and another for HTTPS if tlsEndpoint
+// is given. In sharded mode every shard listens on the same endpoints with
+// SO_REUSEPORT and is run by a single thread, so the kernel spreads accepts
+// between shards and they share no locks.
+struct Shard {
+  Shard(const tcp::endpoint &endpoint, Context &context, bool sharded,
+        int listener, const tcp::endpoint *tlsEndpoint, int tlsListener)
+      : service{sharded ? 1 : numeric_limits<size_t>::max()},
+        server{service, endpoint, context, sharded, false, listener} {
+    if (tlsEndpoint)
+      tlsServer.reset(new Server(service, *tlsEndpoint, context, sharded,
+                                 false, tlsListener, true));
+    else if (tlsListener >= 0)
+      ::close(tlsListener);
+  }
+
+  asio::io_service service;
+  Server server;
+  unique_ptr<Server> tlsServer;
+};
+
+// The cores the process may run on, as taskset or a cpuset may have narrowed
+// them down; empty where that is not known.
+static vector<unsigned> allowedCores() {
+  vector<unsigned> cores;
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (sched_getaffinity(0, sizeof(set), &set) == 0)
+    for (unsigned core = 0; core < CPU_SETSIZE; ++core)
+      if (CPU_ISSET(core, &set))
+        cores.push_back(core);
+#endif
+  return cores;
+}
+
+static void pinToCore(thread &t, unsigned core) {
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(core, &set);
+  pthread_setaffinity_np(t.native_handle(), sizeof(set), &set);
+#endif
+}
+
+static void logConnections(const vector<unique_ptr<Shard>> &shards) {
+  if (!log_)
+    return;
+  for (size_t i = 0; i < shards.size(); ++i)
+    log_->message("Shard " + to_string(i) + " connections " +
+                  to_string(shards[i]->server.connections()));
+}
+
+// Maps the pack at path and serves it from now on. Requests already being
+// answered keep the pack they started with.
+static bool loadPack(Context &context, const string &path) {
+  auto pack = make_shared<Pack::Archive>();
+  string error;
+  if (!pack->open(path, error)) {
+    if (log_)
+      log_->message("Pack not loaded: " + error);
+    return false;
   }
+  if (log_)
+    log_->message("Pack " + path + " with " + to_string(pack->count()) +
+                  " files");
+  atomic_store(&context.pack, shared_ptr<const Pack::Archive>(move(pack)));
+  return true;
 }
+
+// Upgrades without downtime, over a Unix socket. A server started with -U
+// listens there for a successor; a server started with the same -U while
+// one does becomes that successor. It takes the listening sockets over, so
+// connections queued on them are not refused but accepted by the successor,
+// and then takes over the kept-alive connections one by one as they fall
+// idle, while the predecessor finishes the responses it has begun and exits.
+//
+// Every message is a tag byte, some with a descriptor attached:
+//   to the successor: 'L' listener of a shard, 'T' HTTPS listener of a
+//     shard, 'A' listener of the metrics, 'E' end of the listeners, then
+//     'C' connection, 'M' metrics connection
+//   to the predecessor: 'K' once the successor listens
+class Upgrade {
+public:
+  // How long a predecessor waits for the responses it is still writing.
+  static constexpr chrono::seconds drain_limit{60};
+
+  Upgrade(asio::io_service &control, const string &path, Context &context)
+      : path_{path}, context_(context), acceptor_{control},
+        successor_{control}, predecessor_{control}, timer_{control} {}
+
+  ~Upgrade() { closeListeners(); }
+
+  // Takes the listeners of the server running at path, if there is one.
+  void inherit() {
+    asio::error_code error;
+    predecessor_.connect(stream_protocol::endpoint(path_), error);
+    if (error) {
+      // There is none, or only its socket file is left.
+      predecessor_.close(error);
+      return;
+    }
+    for (;;) {
+      char tag;
+      int fd;
+      if (receiveTagged(predecessor_.native_handle(), tag, fd) <= 0)
+        throw runtime_error("the server at " + path_ + " hung up");
+      if (tag == 'E')
+        break;
+      if (tag == 'L' && fd >= 0)
+        listeners_.push_back(fd);
+      else if (tag == 'T' && fd >= 0)
+        tlsListeners_.push_back(fd);
+      else if (tag == 'A' && fd >= 0 && adminListener_ < 0)
+        adminListener_ = fd;
+      else if (fd >= 0)
+        ::close(fd);
+    }
+  }
+
+  // The listener taken over for shard i, or -1. It is the caller's now.
+  int listener(size_t i) { return take(listeners_, i); }
+  int tlsListener(size_t i) { return take(tlsListeners_, i); }
+
+  int adminListener() {
+    int fd = adminListener_;
+    adminListener_ = -1;
+    return fd;
+  }
+
+  // Tells the predecessor, if any, that the servers listen, and waits for
+  // a successor in turn. done is called once one has taken over and the
+  // drain is over.
+  void serve(vector<unique_ptr<Shard>> &shards, Server *admin,
+             function<void()> done) {
+    shards_ = &shards;
+    admin_ = admin;
+    done_ = move(done);
+    size_t unused = closeListeners();
+    if (unused > 0 && log_)
+      log_->message("Upgrade: " + to_string(unused) +
+                    " listeners not taken over");
+    if (predecessor_.is_open()) {
+      if (log_)
+        log_->message("Upgrade: took over from the server at " + path_);
+      sendTagged(predecessor_.native_handle(), 'K', -1);
+      predecessor_.native_non_blocking(true);
+      adoptConnections();
+    }
+    ::unlink(path_.c_str());
+    acceptor_.open();
+    acceptor_.bind(stream_protocol::endpoint(path_));
+    acceptor_.listen(1);
+    waitForSuccessor();
+  }
+
+private:
+  static int take(vector<int> &listeners, size_t i) {
+    if (i >= listeners.size())
+      return -1;
+    int fd = listeners[i];
+    listeners[i] = -1;
+    return fd;
+  }
+
+  size_t closeListeners() {
+    size_t closed = 0;
+    for (auto *listeners : {&listeners_, &tlsListeners_})
+      for (int &fd : *listeners)
+        if (fd >= 0) {
+          ::close(fd);
+          fd = -1;
+          ++closed;
+        }
+    if (adminListener_ >= 0) {
+      ::close(adminListener_);
+      adminListener_ = -1;
+      ++closed;
+    }
+    return closed;
+  }
+
+  // Serves the connections the predecessor sends, spread over the shards,
+  // until it hangs up at the end of its drain.
+  void adoptConnections() {
+    predecessor_.async_read_some(
+        asio::null_buffers(), [this](asio::error_code error, size_t) {
+          if (error)
+            return;
+          for (;;) {
+            char tag;
+            int fd;
+            ssize_t n = receiveTagged(predecessor_.native_handle(), tag, fd);
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+              adoptConnections();
+              return;
+            }
+            if (n <= 0)
+              break;
+            if (fd < 0)
+              continue;
+            if (tag == 'C') {
+              (*shards_)[adopted_++ % shards_->size()]->server.adopt(fd);
+            } else if (tag == 'M' && admin_) {
+              admin_->adopt(fd);
+              ++adopted_;
+            } else {
+              ::close(fd);
+            }
+          }
+          if (log_)
+            log_->message("Upgrade: took over " + to_string(adopted_) +
+                          " connections");
+          asio::error_code ignored_ec;
+          predecessor_.close(ignored_ec);
+        });
+  }
+
+  void waitForSuccessor() {
+    acceptor_.async_accept(successor_, [this](asio::error_code error) {
+      if (!error)
+        handOver();
+    });
+  }
+
+  // Sends the listeners and waits for the successor to listen on them. One
+  // that hangs up instead leaves everything as it was.
+  void handOver() {
+    int socket = successor_.native_handle();
+    bool sent = true;
+    for (auto &shard : *shards_) {
+      sent = sent && sendTagged(socket, 'L', shard->server.listener());
+      if (shard->tlsServer)
+        sent = sent && sendTagged(socket, 'T', shard->tlsServer->listener());
+    }
+    if (admin_)
+      sent = sent && sendTagged(socket, 'A', admin_->listener());
+    sent = sent && sendTagged(socket, 'E', -1);
+    if (!sent) {
+      abandon();
+      return;
+    }
+    successor_.async_read_some(asio::buffer(&ack_, 1),
+                               [this](asio::error_code error, size_t) {
+                                 if (error || ack_ != 'K')
+                                   abandon();
+                                 else
+                                   drain();
+                               });
+  }
+
+  void abandon() {
+    if (log_)
+      log_->message("Upgrade: the successor gave up");
+    asio::error_code ignored_ec;
+    successor_.close(ignored_ec);
+    waitForSuccessor();
+  }
+
+  void drain() {
+    if (log_)
+      log_->message("Upgrade: handing over to a successor");
+    asio::error_code ignored_ec;
+    acceptor_.close(ignored_ec);
+    context_.handoff.begin(successor_);
+    forEachServer([](Server &server) {
+      server.stopAccepting();
+      server.sessions().forEach([](Session &session) { session.handOff(); });
+    });
+    drainUntil_ = chrono::steady_clock::now() + drain_limit;
+    checkDrained();
+  }
+
+  void checkDrained() {
+    size_t left = 0;
+    forEachServer(
+        [&left](Server &server) { left += server.sessions().size(); });
+    if ((left > 0 || context_.handoff.sending()) &&
+        chrono::steady_clock::now() < drainUntil_) {
+      timer_.expires_from_now(chrono::milliseconds(100));
+      timer_.async_wait([this](asio::error_code error) {
+        if (!error)
+          checkDrained();
+      });
+      return;
+    }
+    context_.handoff.end();
+    if (log_)
+      log_->message("Upgrade: handed over " +
+                    to_string(context_.handoff.passed()) +
+                    " connections, cut " + to_string(left));
+    asio::error_code ignored_ec;
+    successor_.close(ignored_ec);
+    done_();
+  }
+
+  template <typename F> void forEachServer(F f) {
+    for (auto &shard : *shards_) {
+      f(shard->server);
+      if (shard->tlsServer)
+        f(*shard->tlsServer);
+    }
+    if (admin_)
+      f(*admin_);
+  }
+
+  string path_;
+  Context &context_;
+  stream_protocol::acceptor acceptor_;
+  stream_protocol::socket successor_;
+  stream_protocol::socket predecessor_;
+  asio::steady_timer timer_;
+  vector<int> listeners_;
+  vector<int> tlsListeners_;
+  int adminListener_ = -1;
+  vector<unique_ptr<Shard>> *shards_ = nullptr;
+  Server *admin_ = nullptr;
+  function<void()> done_;
+  char ack_ = 0;
+  unsigned long adopted_ = 0;
+  chrono::steady_clock::time_point drainUntil_;
+};
+
+constexpr chrono::seconds Upgrade::drain_limit;
 }
 
-void run(string ip, string port, string dir) {
+// Command line settings.
+struct Options {
+  string ip;
+  string port;
+  string dir;
+  unsigned threads = thread::hardware_concurrency();
+  unsigned shards = 0;
+  size_t cacheMegabytes = 64;
+  size_t gzipCacheMegabytes = 32;
+  size_t openFiles = 256;
+  string packFile;
+  string upgradeSocket;
+  unsigned codelTarget = 5; // Milliseconds.
+  int acceptBacklog = 511;
+  unsigned keepAliveSeconds = 5;
+  unsigned headerTimeoutSeconds = 10;
+  unsigned sendTimeoutSeconds = 60;
+  unsigned maxRequests = 100;
+  unsigned logFields = AccessLog::AllFields;
+  string metricsPort;
+  string tlsPort;
+  string certificate;
+  string key;
+  unsigned handshakeThreads = 0; // Handshakes run inline if 0.
+  size_t smallRecordKilobytes = 0;
+};
+
+void run(Options options) {
   try {
-    if (dir.back() == '/')
+    string &ip = options.ip;
+    string &dir = options.dir;
+    unsigned threads = options.threads;
+    unsigned shards = options.shards;
+    if (!dir.empty() && dir.back() == '/')
       dir = dir.substr(0, dir.size() - 1);
     if (ip == "localhost")
       ip = "127.0.0.1";
-    asio::io_service io_service;
-    HttpServer::server(io_service, asio::ip::address::from_string(ip),
-                       stoi(port), dir);
-    io_service.run();
+    asio::ip::address address = asio::ip::address::from_string(ip);
+    tcp::endpoint endpoint(address, stoi(options.port));
+    unique_ptr<tcp::endpoint> tlsEndpoint;
+    if (!options.tlsPort.empty())
+      tlsEndpoint.reset(new tcp::endpoint(address, stoi(options.tlsPort)));
+    HttpServer::Context context(dir, options.cacheMegabytes * 1024 * 1024,
+                                options.gzipCacheMegabytes * 1024 * 1024,
+                                options.openFiles);
+    context.keepAliveTimeout = chrono::seconds(options.keepAliveSeconds);
+    context.headerTimeout = chrono::seconds(options.headerTimeoutSeconds);
+    context.sendTimeout = chrono::seconds(options.sendTimeoutSeconds);
+    context.maxRequests = options.maxRequests;
+    context.admission.setTarget(chrono::milliseconds(options.codelTarget));
+    context.acceptBacklog = options.acceptBacklog;
+    context.smallRecordBytes = options.smallRecordKilobytes * 1024;
+    if (!options.packFile.empty() &&
+        !HttpServer::loadPack(context, options.packFile))
+      throw runtime_error("cannot load " + options.packFile);
+    if (tlsEndpoint)
+      context.tls.reset(
+          new HttpServer::Tls(options.certificate, options.key));
+    // Compression gets a quarter of the cores next to the request workers.
+    context.files.start(dir);
+    context.compressor.start(max(thread::hardware_concurrency() / 4, 1u));
+
+    // The listeners of a running server this one upgrades are taken over
+    // rather than opened anew.
+    asio::io_service control;
+    unique_ptr<HttpServer::Upgrade> upgrade;
+    if (!options.upgradeSocket.empty()) {
+      upgrade.reset(
+          new HttpServer::Upgrade(control, options.upgradeSocket, context));
+      upgrade->inherit();
+    }
+
+    // Without shards a single io_service is shared by all worker threads.
+    bool sharded = shards > 0;
+    vector<unique_ptr<HttpServer::Shard>> all;
+    for (unsigned i = 0; i < (sharded ? shards : 1); ++i)
+      all.emplace_back(new HttpServer::Shard(
+          endpoint, context, sharded, upgrade ? upgrade->listener(i) : -1,
+          tlsEndpoint.get(), upgrade ? upgrade->tlsListener(i) : -1));
+
+    // The metrics are served from a port of their own by the first shard.
+    unique_ptr<HttpServer::Server> admin;
+    if (!options.metricsPort.empty())
+      admin.reset(new HttpServer::Server(
+          all[0]->service, tcp::endpoint(address, stoi(options.metricsPort)),
+          context, false, true, upgrade ? upgrade->adminListener() : -1));
+
+    // Declared after the shards, so that the handshake steps still in the
+    // pool when it goes are posted back to io_services that are still there.
+    unique_ptr<asio::ssl::handshake_pool> handshakePool;
+    if (context.tls && options.handshakeThreads > 0) {
+      handshakePool.reset(
+          new asio::ssl::handshake_pool(options.handshakeThreads));
+      context.handshakePool = handshakePool.get();
+    }
+
+    vector<thread> workers;
+    if (sharded) {
+      vector<unsigned> cores = HttpServer::allowedCores();
+      for (unsigned i = 0; i < shards; ++i) {
+        asio::io_service &service = all[i]->service;
+        workers.emplace_back([&service] { service.run(); });
+        if (!cores.empty())
+          HttpServer::pinToCore(workers.back(), cores[i % cores.size()]);
+      }
+    } else {
+      asio::io_service &service = all[0]->service;
+      for (unsigned i = 0; i < threads; ++i)
+        workers.emplace_back([&service] { service.run(); });
+    }
+
+    auto stop = [&] {
+      HttpServer::logConnections(all);
+      for (auto &shard : all)
+        shard->service.stop();
+      control.stop();
+    };
+    if (upgrade)
+      upgrade->serve(all, admin.get(), stop);
+
+    // SIGUSR1 reports the per-shard connection counts, SIGINT and SIGTERM
+    // stop the server and report them one last time. SIGHUP loads the pack
+    // again, presumably a new one renamed over the old.
+    asio::signal_set signals(control, SIGINT, SIGTERM);
+#ifdef SIGUSR1
+    signals.add(SIGUSR1);
+#endif
+#ifdef SIGHUP
+    if (!options.packFile.empty())
+      signals.add(SIGHUP);
+#endif
+    function<void(const asio::error_code &, int)> onSignal =
+        [&](const asio::error_code &error, int signal) {
+          if (error)
+            return;
+#ifdef SIGHUP
+          if (signal == SIGHUP) {
+            HttpServer::loadPack(context, options.packFile);
+            signals.async_wait(onSignal);
+            return;
+          }
+#endif
+#ifdef SIGUSR1
+          if (signal == SIGUSR1) {
+            HttpServer::logConnections(all);
+            signals.async_wait(onSignal);
+            return;
+          }
+#endif
+          stop();
+        };
+    signals.async_wait(onSignal);
+    control.run();
+
+    for (auto &w : workers)
+      w.join();
   } catch (const exception &e) {
     cerr << "Exception: " << e.what() << "\n";
   }
 }
 
 int main(int argc, char **argv) {
-  string ip;
-  string port;
-  string dir;
+  Options options;
+
+  static const struct option longopts[] = {
+      {"threads", required_argument, NULL, 't'},
+      {"shards", required_argument, NULL, 's'},
+      {"cache", required_argument, NULL, 'c'},
+      {"gzip-cache", required_argument, NULL, 'z'},
+      {"open-files", required_argument, NULL, 'o'},
+      {"pack", required_argument, NULL, 'P'},
+      {"keepalive-timeout", required_argument, NULL, 'k'},
+      {"header-timeout", required_argument, NULL, 'T'},
+      {"send-timeout", required_argument, NULL, 'w'},
+      {"max-requests", required_argument, NULL, 'm'},
+      {"codel-target", required_argument, NULL, 'q'},
+      {"backlog", required_argument, NULL, 'b'},
+      {"log-fields", required_argument, NULL, 'l'},
+      {"metrics-port", required_argument, NULL, 'M'},
+      {"upgrade-socket", required_argument, NULL, 'U'},
+      {"tls-port", required_argument, NULL, 'S'},
+      {"certificate", required_argument, NULL, 'C'},
+      {"key", required_argument, NULL, 'K'},
+      {"handshake-threads", required_argument, NULL, 'H'},
+      {"small-records", required_argument, NULL, 'r'},
+      {NULL, 0, NULL, 0},
+  };
 
   int c;
   int errflg = 0;
   opterr = 0;
-  while ((c = getopt(argc, argv, "h:p:d:")) != -1) {
+  while ((c = getopt_long(argc, argv,
+                          "h:p:d:P:t:s:c:z:o:k:T:w:m:q:b:l:M:U:S:C:K:H:r:",
+                          longopts, NULL)) != -1) {
     switch (c) {
     case 'h':
-      ip = optarg;
+      options.ip = optarg;
       break;
     case 'p':
-      port = optarg;
+      options.port = optarg;
       break;
     case 'd':
-      dir = optarg;
+      options.dir = optarg;
+      break;
+    case 'P':
+      options.packFile = optarg;
+      break;
+    case 't':
+      options.threads = atoi(optarg);
+      break;
+    case 's':
+      options.shards = atoi(optarg);
+      break;
+    case 'c':
+      options.cacheMegabytes = atoi(optarg);
+      break;
+    case 'z':
+      options.gzipCacheMegabytes = atoi(optarg);
+      break;
+    case 'o':
+      options.openFiles = atoi(optarg);
+      break;
+    case 'k':
+      options.keepAliveSeconds = atoi(optarg);
+      break;
+    case 'T':
+      options.headerTimeoutSeconds = atoi(optarg);
+      break;
+    case 'w':
+      options.sendTimeoutSeconds = atoi(optarg);
+      break;
+    case 'm':
+      options.maxRequests = atoi(optarg);
+      break;
+    case 'q':
+      options.codelTarget = atoi(optarg);
+      break;
+    case 'b':
+      options.acceptBacklog = max(atoi(optarg), 1);
+      break;
+    case 'l':
+      if (!AccessLog::parseFields(optarg, options.logFields)) {
+        fprintf(stderr, "Unknown log field in: %s\n", optarg);
+        errflg++;
+      }
+      break;
+    case 'M':
+      options.metricsPort = optarg;
+      break;
+    case 'U':
+      options.upgradeSocket = optarg;
+      break;
+    case 'S':
+      options.tlsPort = optarg;
+      break;
+    case 'C':
+      options.certificate = optarg;
+      break;
+    case 'K':
+      options.key = optarg;
+      break;
+    case 'H':
+      options.handshakeThreads = atoi(optarg);
+      break;
+    case 'r':
+      options.smallRecordKilobytes = atoi(optarg);
       break;
     case ':':
       fprintf(stderr, "Option -%c requires an operand\n", optopt);
@@ -263,12 +3593,36 @@ int main(int argc, char **argv) {
       errflg++;
     }
   }
-  if (errflg || ip.empty() || port.empty() || dir.empty()) {
-    fprintf(stderr, "usage: -h <ip> -p <port> -d <directory>\n");
+  if (options.threads == 0)
+    options.threads = 1;
+  if (errflg || options.ip.empty() || options.port.empty() ||
+      (options.dir.empty() && options.packFile.empty()) ||
+      (!options.tlsPort.empty() &&
+       (options.certificate.empty() || options.key.empty()))) {
+    fprintf(stderr,
+            "usage: -h <ip> -p <port> (-d <directory> | -P <pack file>) "
+            "[-t <threads>] "
+            "[-s <shards>] [-c <cache megabytes>] "
+            "[-z <gzip cache megabytes>] [-o <open files>] "
+            "[-k <keep-alive seconds>] [-T <header timeout seconds>] "
+            "[-w <send timeout seconds>] [-m <max requests>] "
+            "[-q <codel target milliseconds>] [-b <accept backlog>] "
+            "[-l <method,path,status,bytes,latency>] "
+            "[-M <metrics port>] [-U <upgrade socket>] "
+            "[-S <tls port> -C <certificate chain file> "
+            "-K <private key file> [-H <handshake threads>] "
+            "[-r <small record kilobytes>]]\n");
     exit(2);
   }
 
-#ifndef WIN32
+  // The pack is loaded again on SIGHUP, and the upgrade socket bound and the
+  // certificate read, long after the chdir below.
+  char cwd[PATH_MAX];
+  for (string *path : {&options.packFile, &options.upgradeSocket,
+                       &options.certificate, &options.key})
+    if (!path->empty() && (*path)[0] != '/' && getcwd(cwd, sizeof(cwd)))
+      *path = string(cwd) + "/" + *path;
+
   pid_t pid, sid;
   pid = fork();
   if (pid < 0) {
@@ -284,7 +3638,7 @@ int main(int argc, char **argv) {
   umask(0);
 
   /* Open any logs here */
-  log_ = new ofstream("/home/box/log.txt", ios_base::trunc | ios_base::out);
+  log_ = new AccessLog("/home/box/log.txt", options.logFields);
 
   /* Create a new SID for the child process */
   sid = setsid();
@@ -303,141 +3657,14 @@ int main(int argc, char **argv) {
   close(STDIN_FILENO);
   close(STDOUT_FILENO);
   close(STDERR_FILENO);
-#endif
 
   if (log_)
-    *log_ << "Open " << ip << " " << port << " " << dir << endl;
+    log_->message("Open " + options.ip + " " + options.port + " " +
+                  options.dir + " " + to_string(options.threads) + " " +
+                  to_string(options.shards));
 
-  run(ip, port, dir);
+  run(options);
 
+  delete log_;
   return 0;
 }
-
-///////////////////////////////////////////////////////////////////////////////
-// getopt.c
-///////////////////////////////////////////////////////////////////////////////
-#ifdef WIN32
-const int no_argument = 0;
-const int required_argument = 1;
-const int optional_argument = 2;
-
-char *optarg;
-int optopt;
-/* The variable optind [...] shall be initialized to 1 by the system. */
-int optind = 1;
-int opterr;
-
-static char *optcursor = NULL;
-
-/* Implemented based on [1] and [2] for optional arguments.
-   optopt is handled FreeBSD-style, per [3].
-   Other GNU and FreeBSD extensions are purely accidental.
-
-[1] http://pubs.opengroup.org/onlinepubs/000095399/functions/getopt.html
-[2] http://www.kernel.org/doc/man-pages/online/pages/man3/getopt.3.html
-[3]
-http://www.freebsd.org/cgi/man.cgi?query=getopt&sektion=3&manpath=FreeBSD+9.0-RELEASE
-*/
-int getopt(int argc, char *const argv[], const char *optstring) {
-  int optchar = -1;
-  const char *optdecl = NULL;
-
-  optarg = NULL;
-  opterr = 0;
-  optopt = 0;
-
-  /* Unspecified, but we need it to avoid overrunning the argv bounds. */
-  if (optind >= argc)
-    goto no_more_optchars;
-
-  /* If, when getopt() is called argv[optind] is a null pointer, getopt()
-     shall return -1 without changing optind. */
-  if (argv[optind] == NULL)
-    goto no_more_optchars;
-
-  /* If, when getopt() is called *argv[optind]  is not the character '-',
-     getopt() shall return -1 without changing optind. */
-  if (*argv[optind] != '-')
-    goto no_more_optchars;
-
-  /* If, when getopt() is called argv[optind] points to the string "-",
-     getopt() shall return -1 without changing optind. */
-  if (strcmp(argv[optind], "-") == 0)
-    goto no_more_optchars;
-
-  /* If, when getopt() is called argv[optind] points to the string "--",
-     getopt() shall return -1 after incrementing optind. */
-  if (strcmp(argv[optind], "--") == 0) {
-    ++optind;
-    goto no_more_optchars;
-  }
-
-  if (optcursor == NULL || *optcursor == '\0')
-    optcursor = argv[optind] + 1;
-
-  optchar = *optcursor;
-
-  /* FreeBSD: The variable optopt saves the last known option character
-     returned by getopt(). */
-  optopt = optchar;
-
-  /* The getopt() function shall return the next option character (if one is
-     found) from argv that matches a character in optstring, if there is
-     one that matches. */
-  optdecl = strchr(optstring, optchar);
-  if (optdecl) {
-    /* [I]f a character is followed by a colon, the option takes an
-       argument. */
-    if (optdecl[1] == ':') {
-      optarg = ++optcursor;
-      if (*optarg == '\0') {
-        /* GNU extension: Two colons mean an option takes an
-           optional arg; if there is text in the current argv-element
-           (i.e., in the same word as the option name itself, for example,
-           "-oarg"), then it is returned in optarg, otherwise optarg is set
-           to zero. */
-        if (optdecl[2] != ':') {
-          /* If the option was the last character in the string pointed to by
-             an element of argv, then optarg shall contain the next element
-             of argv, and optind shall be incremented by 2. If the resulting
-             value of optind is greater than argc, this indicates a missing
-             option-argument, and getopt() shall return an error indication.
-
-             Otherwise, optarg shall point to the string following the
-             option character in that element of argv, and optind shall be
-             incremented by 1.
-          */
-          if (++optind < argc) {
-            optarg = argv[optind];
-          } else {
-            /* If it detects a missing option-argument, it shall return the
-               colon character ( ':' ) if the first character of optstring
-               was a colon, or a question-mark character ( '?' ) otherwise.
-            */
-            optarg = NULL;
-            optchar = (optstring[0] == ':') ? ':' : '?';
-          }
-        } else {
-          optarg = NULL;
-        }
-      }
-
-      optcursor = NULL;
-    }
-  } else {
-    /* If getopt() encounters an option character that is not contained in
-       optstring, it shall return the question-mark ( '?' ) character. */
-    optchar = '?';
-  }
-
-  if (optcursor == NULL || *++optcursor == '\0')
-    ++optind;
-
-  return optchar;
-
-no_more_optchars:
-  optcursor = NULL;
-  return -1;
-}
-
-#endif
@@ -0,0 +1,275 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <numeric>
+#include <string>
+#include <vector>
+
+#include <dirent.h>
+#include <getopt.h>
+#include <sys/stat.h>
+
+#include "pack_format.hpp"
+
+///////////////////////////////////////////////////////////////////////////////
+// pack -d <directory> -o <pack file>
+//
+// Builds a content pack of a directory for final -P. Every file goes in with
+// its response rendered in advance, along with gzip and brotli variants taken
+// from .gz and .br sidecars, or for gzip made here. The pack is written next
+// to its destination and renamed over it, so that a running server switches
+// to it on SIGHUP without ever seeing half a pack.
+///////////////////////////////////////////////////////////////////////////////
+
+using namespace std;
+using namespace HttpServer;
+
+namespace PackTool {
+
+// Files smaller than this are not worth a Content-Encoding.
+static const size_t min_gzip_size = 256;
+static const uint32_t max_seed = 1 << 20;
+
+struct File {
+  string path; // As requested.
+  string fullPath;
+  struct stat st;
+};
+
+// Collects the regular files below dir. Symbolic links to files are followed
+// as final would, those to directories are not, which rules out loops.
+static void walk(const string &dir, const string &prefix,
+                 vector<File> &files) {
+  DIR *d = opendir(dir.c_str());
+  if (!d)
+    return;
+  while (dirent *e = readdir(d)) {
+    string name = e->d_name;
+    if (name == "." || name == "..")
+      continue;
+    File file{prefix + "/" + name, dir + "/" + name, {}};
+    if (lstat(file.fullPath.c_str(), &file.st) != 0)
+      continue;
+    if (S_ISDIR(file.st.st_mode)) {
+      walk(file.fullPath, file.path, files);
+      continue;
+    }
+    if (S_ISLNK(file.st.st_mode) &&
+        stat(file.fullPath.c_str(), &file.st) != 0)
+      continue;
+    if (S_ISREG(file.st.st_mode))
+      files.push_back(file);
+  }
+  closedir(d);
+}
+
+// Reads the whole file at path into out, failing if it cannot be opened or
+// read to the end.
+static bool readFile(const string &path, string &out) {
+  FILE *f = fopen(path.c_str(), "rb");
+  if (!f)
+    return false;
+  out.clear();
+  char buffer[64 * 1024];
+  size_t n;
+  while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0)
+    out.append(buffer, n);
+  bool ok = !ferror(f);
+  fclose(f);
+  return ok;
+}
+
+// Finds a seed for every bucket that sends all of its paths to free slots,
+// placing the largest buckets first while most slots are still free.
+static bool buildHash(const vector<File> &files, uint32_t bucketCount,
+                      vector<uint32_t> &seeds, vector<uint32_t> &slots) {
+  uint32_t count = files.size();
+  vector<vector<uint32_t>> buckets(bucketCount);
+  for (uint32_t i = 0; i < count; ++i) {
+    const string &path = files[i].path;
+    buckets[Pack::bucketOf(path.data(), path.size(), bucketCount)].push_back(
+        i);
+  }
+  vector<uint32_t> order(bucketCount);
+  iota(order.begin(), order.end(), 0);
+  sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+    return buckets[a].size() > buckets[b].size();
+  });
+
+  vector<bool> taken(count);
+  seeds.assign(bucketCount, 1);
+  slots.assign(count, 0);
+  vector<uint32_t> chosen;
+  for (uint32_t b : order) {
+    const auto &bucket = buckets[b];
+    if (bucket.empty())
+      break;
+    for (uint32_t seed = 1;; ++seed) {
+      if (seed > max_seed)
+        return false;
+      chosen.clear();
+      for (uint32_t i : bucket) {
+        const string &path = files[i].path;
+        uint32_t slot = Pack::slotOf(path.data(), path.size(), seed, count);
+        if (taken[slot] ||
+            find(chosen.begin(), chosen.end(), slot) != chosen.end())
+          break;
+        chosen.push_back(slot);
+      }
+      if (chosen.size() < bucket.size())
+        continue;
+      for (size_t k = 0; k < bucket.size(); ++k) {
+        taken[chosen[k]] = true;
+        slots[bucket[k]] = chosen[k];
+      }
+      seeds[b] = seed;
+      break;
+    }
+  }
+  return true;
+}
+
+static bool writePack(const string &dir, const string &output) {
+  vector<File> files;
+  walk(dir, "", files);
+  uint32_t count = files.size();
+
+  // About four paths per bucket; more buckets if no seeds can be found.
+  uint32_t bucketCount = count / 4 + 1;
+  vector<uint32_t> seeds;
+  vector<uint32_t> slots;
+  while (!buildHash(files, bucketCount, seeds, slots)) {
+    if (bucketCount >= count) {
+      fprintf(stderr, "No perfect hash found for %u paths\n", count);
+      return false;
+    }
+    bucketCount = min(bucketCount * 2, count);
+  }
+
+  string temporary = output + ".tmp";
+  ofstream os(temporary.c_str(), ios::out | ios::binary | ios::trunc);
+  vector<Pack::Entry> entries(count);
+  uint64_t offset =
+      Pack::entriesOffset(bucketCount) + uint64_t(count) * sizeof(Pack::Entry);
+  size_t variants = 0;
+
+  // Paths and responses follow the entries in the order of the files, and
+  // the entries are filled in on the way.
+  os.seekp(offset);
+  for (uint32_t i = 0; i < count; ++i) {
+    const File &file = files[i];
+    Pack::Entry &entry = entries[slots[i]];
+    entry.pathOffset = offset;
+    entry.pathLength = file.path.size();
+    os.write(file.path.data(), file.path.size());
+    offset += file.path.size();
+
+    Representation rep;
+    rep.stamp = FileStamp(file.st);
+    rep.type = mimeType(file.path);
+    entry.ino = rep.stamp.ino;
+    entry.size = rep.stamp.size;
+    entry.mtime = rep.stamp.mtime;
+    entry.mtimeNsec = rep.stamp.mtimeNsec;
+
+    // Sidecars count as they do for final: only if not older than the file.
+    string bodies[encoding_count];
+    if (!readFile(file.fullPath, bodies[0])) {
+      fprintf(stderr, "Cannot read %s\n", file.fullPath.c_str());
+      return false;
+    }
+    for (size_t e = 1; e < encoding_count; ++e) {
+      struct stat st;
+      string sidecar = file.fullPath + encodingSuffixes[e];
+      if (stat(sidecar.c_str(), &st) == 0 && S_ISREG(st.st_mode) &&
+          st.st_mtime >= file.st.st_mtime && !readFile(sidecar, bodies[e])) {
+        fprintf(stderr, "Cannot read %s\n", sidecar.c_str());
+        return false;
+      }
+    }
+    const string &identity = bodies[0];
+    string &gzipped = bodies[static_cast<int>(Encoding::Gzip)];
+    if (gzipped.empty() && rep.type->compressible &&
+        identity.size() >= min_gzip_size &&
+        (!gzip(identity, gzipped) || gzipped.size() >= identity.size()))
+      gzipped.clear();
+
+    for (size_t e = 1; e < encoding_count; ++e)
+      rep.vary = rep.vary || !bodies[e].empty();
+    for (size_t e = 0; e < encoding_count; ++e) {
+      if (e > 0 && bodies[e].empty())
+        continue;
+      rep.encoding = static_cast<Encoding>(e);
+      string head = headerFor(rep, bodies[e].size());
+      entry.variants[e] =
+          Pack::Variant{offset, head.size(), bodies[e].size()};
+      os.write(head.data(), head.size());
+      os.write(bodies[e].data(), bodies[e].size());
+      offset += head.size() + bodies[e].size();
+      ++variants;
+    }
+  }
+
+  Pack::Header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, Pack::magic, sizeof(header.magic));
+  header.version = Pack::version;
+  header.count = count;
+  header.bucketCount = bucketCount;
+  header.size = offset;
+  os.seekp(0);
+  os.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  os.write(reinterpret_cast<const char *>(seeds.data()),
+           seeds.size() * sizeof(uint32_t));
+  os.seekp(Pack::entriesOffset(bucketCount));
+  os.write(reinterpret_cast<const char *>(entries.data()),
+           entries.size() * sizeof(Pack::Entry));
+  os.close();
+  if (!os || rename(temporary.c_str(), output.c_str()) != 0) {
+    fprintf(stderr, "Cannot write %s\n", output.c_str());
+    remove(temporary.c_str());
+    return false;
+  }
+  printf("%u files, %zu responses, %llu bytes in %s\n", count, variants,
+         static_cast<unsigned long long>(offset), output.c_str());
+  return true;
+}
+}
+
+int main(int argc, char **argv) {
+  string dir;
+  string output;
+
+  static const struct option longopts[] = {
+      {"directory", required_argument, NULL, 'd'},
+      {"output", required_argument, NULL, 'o'},
+      {NULL, 0, NULL, 0},
+  };
+
+  int c;
+  int errflg = 0;
+  opterr = 0;
+  while ((c = getopt_long(argc, argv, "d:o:", longopts, NULL)) != -1) {
+    switch (c) {
+    case 'd':
+      dir = optarg;
+      break;
+    case 'o':
+      output = optarg;
+      break;
+    case '?':
+      fprintf(stderr, "Unrecognized option: -%c\n", optopt);
+      errflg++;
+    }
+  }
+  if (errflg || dir.empty() || output.empty()) {
+    fprintf(stderr, "usage: -d <directory> -o <pack file>\n");
+    return 2;
+  }
+  if (dir.size() > 1 && dir.back() == '/')
+    dir.pop_back();
+
+  return PackTool::writePack(dir, output) ? 0 : 1;
+}
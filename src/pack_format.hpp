@@ -0,0 +1,206 @@
+#ifndef PACK_FORMAT_HPP
+#define PACK_FORMAT_HPP
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "representation.hpp"
+
+// A content pack holds every file of a directory together with the complete
+// responses final would send for it, in each coding it has. The server maps
+// the pack and serves straight from the mapping; it never writes to it.
+//
+//   Header | seeds[bucketCount] | entries[count] | paths and responses
+//
+// Entries are placed by a minimal perfect hash of the request path: the path
+// hashes to a bucket, and the seed of the bucket sends it to a slot of its
+// own among the entries. Integers are in host byte order; a pack is meant to
+// be read on the kind of machine that wrote it.
+
+namespace HttpServer {
+
+namespace Pack {
+
+static const char magic[8] = {'H', 'T', 'T', 'P', 'P', 'A', 'C', 'K'};
+static const uint32_t version = 1;
+
+struct Header {
+  char magic[8];
+  uint32_t version;
+  uint32_t count;       // Of entries, one per file.
+  uint32_t bucketCount; // Of seeds.
+  uint32_t reserved;
+  uint64_t size; // Of the whole pack.
+};
+
+// One coding of a file: a complete 200 response, head and then body.
+struct Variant {
+  uint64_t offset;
+  uint64_t headLength; // 0 if the file does not come in the coding.
+  uint64_t bodyLength;
+};
+
+struct Entry {
+  uint64_t pathOffset;
+  uint64_t pathLength;
+  // The stamp of the file when it was packed, which the validators of its
+  // responses are made of.
+  uint64_t ino;
+  uint64_t size;
+  int64_t mtime;
+  int64_t mtimeNsec;
+  Variant variants[encoding_count];
+};
+
+// The 64-bit FNV-1a hash of the path started from the seed, with the
+// splitmix64 finalizer on top so that every bit depends on every byte.
+inline uint64_t hash(const char *data, size_t size, uint64_t seed) {
+  uint64_t h = 14695981039346656037ull ^ (seed * 0x9e3779b97f4a7c15ull);
+  for (size_t i = 0; i < size; ++i) {
+    h ^= static_cast<unsigned char>(data[i]);
+    h *= 1099511628211ull;
+  }
+  h ^= h >> 30;
+  h *= 0xbf58476d1ce4e5b9ull;
+  h ^= h >> 27;
+  h *= 0x94d049bb133111ebull;
+  h ^= h >> 31;
+  return h;
+}
+
+// Seed 0 picks the bucket; the seeds of buckets start at 1.
+inline uint32_t bucketOf(const char *data, size_t size, uint32_t bucketCount) {
+  return hash(data, size, 0) % bucketCount;
+}
+
+inline uint32_t slotOf(const char *data, size_t size, uint32_t seed,
+                       uint32_t count) {
+  return hash(data, size, seed) % count;
+}
+
+inline size_t seedsOffset() { return sizeof(Header); }
+
+inline size_t entriesOffset(uint32_t bucketCount) {
+  size_t offset = seedsOffset() + bucketCount * sizeof(uint32_t);
+  return (offset + 7) & ~size_t(7);
+}
+
+// A pack mapped read-only. Deploying a new pack by renaming it over the old
+// one leaves the mapping of the old one intact for as long as it is used.
+class Archive {
+public:
+  Archive() = default;
+  Archive(const Archive &) = delete;
+  Archive &operator=(const Archive &) = delete;
+  ~Archive() {
+    if (base_)
+      munmap(const_cast<char *>(base_), size_);
+  }
+
+  // Maps and checks the pack at path, describing what is wrong in error.
+  bool open(const std::string &path, std::string &error) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      error = "cannot open " + path + ": " + strerror(errno);
+      return false;
+    }
+    struct stat st;
+    void *p = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size >= off_t(sizeof(Header)))
+      p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED) {
+      error = "cannot map " + path;
+      return false;
+    }
+    base_ = static_cast<const char *>(p);
+    size_ = st.st_size;
+    if (!valid()) {
+      error = path + " is not a valid pack";
+      return false;
+    }
+    return true;
+  }
+
+  // Looks the request path up with two hashes and no system call.
+  const Entry *find(const char *path, size_t size) const {
+    if (header().count == 0)
+      return nullptr;
+    uint32_t seed = seeds()[bucketOf(path, size, header().bucketCount)];
+    const Entry &entry = entries()[slotOf(path, size, seed, header().count)];
+    if (entry.pathLength != size ||
+        memcmp(base_ + entry.pathOffset, path, size) != 0)
+      return nullptr;
+    return &entry;
+  }
+
+  FileStamp stamp(const Entry &entry) const {
+    FileStamp stamp;
+    stamp.ino = entry.ino;
+    stamp.size = entry.size;
+    stamp.mtime = entry.mtime;
+    stamp.mtimeNsec = entry.mtimeNsec;
+    return stamp;
+  }
+
+  const char *data() const { return base_; }
+  size_t count() const { return header().count; }
+
+private:
+  const Header &header() const {
+    return *reinterpret_cast<const Header *>(base_);
+  }
+  const uint32_t *seeds() const {
+    return reinterpret_cast<const uint32_t *>(base_ + seedsOffset());
+  }
+  const Entry *entries() const {
+    return reinterpret_cast<const Entry *>(
+        base_ + entriesOffset(header().bucketCount));
+  }
+
+  // Checks every offset once, and that every head ends in a blank line, so
+  // that lookups and the writing of responses need not.
+  bool valid() const {
+    const Header &h = header();
+    if (memcmp(h.magic, magic, sizeof(magic)) != 0 || h.version != version ||
+        h.size != size_ || (h.count > 0 && h.bucketCount == 0))
+      return false;
+    uint64_t entriesEnd =
+        entriesOffset(h.bucketCount) + uint64_t(h.count) * sizeof(Entry);
+    if (entriesEnd > size_)
+      return false;
+    for (size_t i = 0; i < h.count; ++i) {
+      const Entry &e = entries()[i];
+      if (e.pathOffset > size_ || e.pathLength > size_ - e.pathOffset)
+        return false;
+      for (const auto &v : e.variants) {
+        if (v.offset > size_ || v.headLength > size_ - v.offset ||
+            v.bodyLength > size_ - v.offset - v.headLength)
+          return false;
+        if (v.headLength > 0 &&
+            (v.headLength < 4 ||
+             memcmp(base_ + v.offset + v.headLength - 4, "\r\n\r\n", 4) != 0))
+          return false;
+      }
+      if (e.variants[0].headLength == 0)
+        return false;
+    }
+    return true;
+  }
+
+  const char *base_ = nullptr;
+  size_t size_ = 0;
+};
+
+} // namespace Pack
+
+} // namespace HttpServer
+
+#endif // PACK_FORMAT_HPP
@@ -0,0 +1,185 @@
+#ifndef REPRESENTATION_HPP
+#define REPRESENTATION_HPP
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <sstream>
+#include <string>
+#include <zlib.h>
+
+#include <strings.h>
+#include <sys/stat.h>
+
+// What the server sends for a file, shared by final and the pack tool so that
+// a packed response is byte for byte the one final would send.
+
+namespace HttpServer {
+
+// Identifies one version of a file; any change to the file changes it.
+struct FileStamp {
+  FileStamp() = default;
+  explicit FileStamp(const struct stat &st)
+      : ino{st.st_ino}, size{st.st_size}, mtime{st.st_mtime} {
+#ifdef __linux__
+    mtimeNsec = st.st_mtim.tv_nsec;
+#endif
+  }
+
+  bool operator==(const FileStamp &other) const {
+    return ino == other.ino && size == other.size && mtime == other.mtime &&
+           mtimeNsec == other.mtimeNsec;
+  }
+  bool operator!=(const FileStamp &other) const { return !(*this == other); }
+
+  // A strong validator that changes with any change of the stamp.
+  std::string etag() const {
+    char buf[64];
+    snprintf(buf, sizeof(buf), "\"%llx-%llx-%llx\"",
+             static_cast<unsigned long long>(ino),
+             static_cast<unsigned long long>(size),
+             static_cast<unsigned long long>(mtime) * 1000000000ull +
+                 mtimeNsec);
+    return buf;
+  }
+
+  // The modification time as an HTTP-date.
+  std::string lastModified() const {
+    char buf[64];
+    struct tm tm;
+    gmtime_r(&mtime, &tm);
+    strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    return buf;
+  }
+
+  ino_t ino = 0;
+  off_t size = 0;
+  time_t mtime = 0;
+  long mtimeNsec = 0;
+};
+
+// Content codings the server can send, in increasing order of preference.
+enum class Encoding {
+  Identity,
+  Gzip,
+  Brotli,
+};
+
+static const size_t encoding_count = 3;
+static const char *const encodingNames[] = {"identity", "gzip", "br"};
+static const char *const encodingSuffixes[] = {"", ".gz", ".br"};
+
+inline unsigned bitOf(Encoding encoding) {
+  return 1u << static_cast<unsigned>(encoding);
+}
+
+// The media type of a file, and whether gzip is worth trying on it.
+struct MimeType {
+  const char *extension;
+  const char *name;
+  bool compressible;
+};
+
+static const MimeType mimeTypes[] = {
+    {"html", "text/html", true},
+    {"htm", "text/html", true},
+    {"css", "text/css", true},
+    {"js", "application/javascript", true},
+    {"json", "application/json", true},
+    {"txt", "text/plain", true},
+    {"csv", "text/csv", true},
+    {"xml", "application/xml", true},
+    {"svg", "image/svg+xml", true},
+    {"wasm", "application/wasm", true},
+    {"png", "image/png", false},
+    {"jpg", "image/jpeg", false},
+    {"jpeg", "image/jpeg", false},
+    {"gif", "image/gif", false},
+    {"webp", "image/webp", false},
+    {"ico", "image/x-icon", false},
+    {"woff", "font/woff", false},
+    {"woff2", "font/woff2", false},
+    {"pdf", "application/pdf", false},
+    {"zip", "application/zip", false},
+    {"gz", "application/gzip", false},
+    {"mp4", "video/mp4", false},
+    {"bin", "application/octet-stream", false},
+};
+
+// Files of unknown types keep being served as HTML, but are not compressed.
+static const MimeType defaultMimeType = {"", "text/html", false};
+
+// Looks the media type up by the extension of the path, ignoring case.
+inline const MimeType *mimeType(const std::string &path) {
+  size_t dot = path.rfind('.');
+  if (dot == std::string::npos || path.find('/', dot) != std::string::npos)
+    return &defaultMimeType;
+  for (const auto &type : mimeTypes)
+    if (strcasecmp(path.c_str() + dot + 1, type.extension) == 0)
+      return &type;
+  return &defaultMimeType;
+}
+
+// What a response carries: the current version of a file in one content
+// coding, possibly one of several.
+struct Representation {
+  // Validators differ between the codings of one version.
+  std::string etag() const {
+    std::string etag = stamp.etag();
+    if (encoding != Encoding::Identity)
+      etag.insert(etag.size() - 1,
+                  std::string("-") + encodingNames[static_cast<int>(encoding)]);
+    return etag;
+  }
+
+  // Header fields describing the representation, each ending in CRLF.
+  std::string headers() const {
+    std::string headers = "Accept-Ranges: bytes\r\nETag: " + etag() +
+                     "\r\nLast-Modified: " + stamp.lastModified() + "\r\n";
+    if (encoding != Encoding::Identity)
+      headers += std::string("Content-Encoding: ") +
+                 encodingNames[static_cast<int>(encoding)] + "\r\n";
+    if (vary)
+      headers += "Vary: Accept-Encoding\r\n";
+    return headers;
+  }
+
+  FileStamp stamp; // Of the original file.
+  const MimeType *type = &defaultMimeType;
+  Encoding encoding = Encoding::Identity;
+  bool vary = false; // Whether the file has other codings.
+};
+
+// The head of a complete 200 response carrying the representation.
+inline std::string headerFor(const Representation &rep, uint64_t length) {
+  std::stringstream resp;
+  resp << "HTTP/1.1 200 OK\r\nContent-Length: " << length
+       << "\r\nContent-type: " << rep.type->name << "\r\n"
+       << rep.headers() << "\r\n";
+  return resp.str();
+}
+
+// Gzips the whole of in into out, with the gzip wrapper.
+inline bool gzip(const std::string &in, std::string &out) {
+  z_stream zs;
+  memset(&zs, 0, sizeof(zs));
+  // The work is done once per version of a file, off the request path, so
+  // it pays to compress as hard as zlib can.
+  if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+                   Z_DEFAULT_STRATEGY) != Z_OK)
+    return false;
+  out.resize(deflateBound(&zs, in.size()));
+  zs.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(in.data()));
+  zs.avail_in = in.size();
+  zs.next_out = reinterpret_cast<Bytef *>(&out[0]);
+  zs.avail_out = out.size();
+  int status = deflate(&zs, Z_FINISH);
+  out.resize(zs.total_out);
+  deflateEnd(&zs);
+  return status == Z_STREAM_END;
+}
+
+} // namespace HttpServer
+
+#endif // REPRESENTATION_HPP
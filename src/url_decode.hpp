@@ -0,0 +1,141 @@
+#ifndef URL_DECODE_HPP
+#define URL_DECODE_HPP
+
+#include <cstring>
+#include <string>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define URL_DECODE_HAS_AVX2
+#endif
+
+namespace HttpServer {
+
+namespace detail {
+
+// Value of every byte as a hex digit, or -1 if it is not one.
+static const signed char hexValue[256] = {
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+     0,  1,  2,  3,  4,  5,  6,  7,  8,  9, -1, -1, -1, -1, -1, -1,
+    -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+};
+
+inline bool isSpecial(char c) { return c == '%' || c == '+'; }
+
+// Returns the index of the first '%' or '+' in [begin, end), or end.
+inline size_t findSpecialScalar(const char *s, size_t begin, size_t end) {
+  while (begin < end && !isSpecial(s[begin]))
+    ++begin;
+  return begin;
+}
+
+#if defined(__SSE2__)
+inline size_t findSpecialSse2(const char *s, size_t begin, size_t end) {
+  const __m128i percent = _mm_set1_epi8('%');
+  const __m128i plus = _mm_set1_epi8('+');
+  for (; begin + 16 <= end; begin += 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s + begin));
+    int mask = _mm_movemask_epi8(
+        _mm_or_si128(_mm_cmpeq_epi8(v, percent), _mm_cmpeq_epi8(v, plus)));
+    if (mask)
+      return begin + __builtin_ctz(mask);
+  }
+  return findSpecialScalar(s, begin, end);
+}
+#endif
+
+#ifdef URL_DECODE_HAS_AVX2
+__attribute__((target("avx2"))) inline size_t
+findSpecialAvx2(const char *s, size_t begin, size_t end) {
+  const __m256i percent = _mm256_set1_epi8('%');
+  const __m256i plus = _mm256_set1_epi8('+');
+  for (; begin + 32 <= end; begin += 32) {
+    __m256i v =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(s + begin));
+    int mask = _mm256_movemask_epi8(_mm256_or_si256(
+        _mm256_cmpeq_epi8(v, percent), _mm256_cmpeq_epi8(v, plus)));
+    if (mask)
+      return begin + __builtin_ctz(mask);
+  }
+  return findSpecialScalar(s, begin, end);
+}
+#endif
+
+typedef size_t (*FindSpecial)(const char *, size_t, size_t);
+
+// Picks the widest scanner the CPU supports, once.
+inline FindSpecial findSpecial() {
+  static const FindSpecial best = [] {
+#ifdef URL_DECODE_HAS_AVX2
+    if (__builtin_cpu_supports("avx2"))
+      return &findSpecialAvx2;
+#endif
+#if defined(__SSE2__)
+    return &findSpecialSse2;
+#else
+    return &findSpecialScalar;
+#endif
+  }();
+  return best;
+}
+
+} // namespace detail
+
+// Decodes %XX escapes and '+' in a URL path. Runs without escapes are found
+// 16 or 32 bytes at a time and copied in bulk; only the escapes themselves
+// are decoded byte by byte. Fails on an escape that is cut short or is not
+// followed by two hex digits.
+inline bool urlDecode(const char *src, size_t size, std::string &out) {
+  const detail::FindSpecial find = detail::findSpecial();
+
+  out.resize(size);
+  char *begin = &out[0];
+  char *dst = begin;
+  for (size_t i = 0; i < size;) {
+    size_t special = find(src, i, size);
+    memcpy(dst, src + i, special - i);
+    dst += special - i;
+    i = special;
+    if (i == size)
+      break;
+    if (src[i] == '+') {
+      *dst++ = ' ';
+      ++i;
+      continue;
+    }
+    if (i + 3 > size)
+      return false;
+    int high = detail::hexValue[static_cast<unsigned char>(src[i + 1])];
+    int low = detail::hexValue[static_cast<unsigned char>(src[i + 2])];
+    if ((high | low) < 0)
+      return false;
+    *dst++ = static_cast<char>(high << 4 | low);
+    i += 3;
+  }
+  out.resize(dst - begin);
+  return true;
+}
+
+inline bool urlDecode(const std::string &in, std::string &out) {
+  return urlDecode(in.data(), in.size(), out);
+}
+
+} // namespace HttpServer
+
+#endif // URL_DECODE_HPP
@@ -0,0 +1,120 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "url_decode.hpp"
+
+///////////////////////////////////////////////////////////////////////////////
+// url_decode_bench [iterations]
+//
+// Compares HttpServer::urlDecode with the stringstream based decoder it
+// replaced, on paths with no, some and mostly escaped characters.
+///////////////////////////////////////////////////////////////////////////////
+
+using namespace std;
+
+// The decoder Session::urlDecode used before, kept as the baseline.
+static bool legacyUrlDecode(const string &in, string &out) {
+  out.clear();
+  out.reserve(in.size());
+  for (size_t i = 0; i < in.size(); ++i) {
+    if (in[i] == '%') {
+      if (i + 3 <= in.size()) {
+        int value = 0;
+        istringstream is(in.substr(i + 1, 2));
+        if (is >> hex >> value) {
+          out += static_cast<char>(value);
+          i += 2;
+        } else {
+          return false;
+        }
+      } else {
+        return false;
+      }
+    } else if (in[i] == '+') {
+      out += ' ';
+    } else {
+      out += in[i];
+    }
+  }
+  return true;
+}
+
+static string escapeEvery(const string &in, size_t every) {
+  static const char digits[] = "0123456789ABCDEF";
+  string out;
+  for (size_t i = 0; i < in.size(); ++i) {
+    unsigned char c = in[i];
+    if (i % every == 0) {
+      out += '%';
+      out += digits[c >> 4];
+      out += digits[c & 15];
+    } else {
+      out += c;
+    }
+  }
+  return out;
+}
+
+typedef bool (*Decode)(const string &, string &);
+
+static double nsPerByte(Decode decode, const vector<string> &inputs,
+                        long iterations) {
+  string out;
+  size_t bytes = 0;
+  auto start = chrono::steady_clock::now();
+  for (long n = 0; n < iterations; ++n) {
+    for (const auto &in : inputs) {
+      if (!decode(in, out))
+        abort();
+      bytes += in.size();
+    }
+  }
+  auto elapsed = chrono::duration_cast<chrono::nanoseconds>(
+      chrono::steady_clock::now() - start);
+  return static_cast<double>(elapsed.count()) / bytes;
+}
+
+int main(int argc, char **argv) {
+  long iterations = argc > 1 ? atol(argv[1]) : 20000;
+
+  string plain = "/static/assets/javascripts/application-bundle.min.js";
+  string longPlain;
+  while (longPlain.size() < 1000)
+    longPlain += "/a/rather/deep/directory/tree/of/plain/ascii/names";
+
+  struct Corpus {
+    const char *name;
+    vector<string> inputs;
+  };
+  vector<Corpus> corpora = {
+      {"plain", {plain, "/index.html", "/images/logo.png"}},
+      {"long plain", {longPlain}},
+      {"some escapes", {escapeEvery(longPlain, 16), "/my+file+name.txt"}},
+      {"all escapes", {escapeEvery(longPlain, 1)}},
+  };
+
+  printf("%-14s %12s %12s %9s\n", "corpus", "legacy ns/B", "simd ns/B",
+         "speedup");
+  for (const auto &corpus : corpora) {
+    // Both decoders have to agree before their speed means anything.
+    for (const auto &in : corpus.inputs) {
+      string expected;
+      string actual;
+      if (!legacyUrlDecode(in, expected) ||
+          !HttpServer::urlDecode(in, actual) || expected != actual) {
+        fprintf(stderr, "mismatch on %s\n", in.c_str());
+        return 1;
+      }
+    }
+
+    double legacy = nsPerByte(legacyUrlDecode, corpus.inputs, iterations / 10);
+    double simd = nsPerByte(HttpServer::urlDecode, corpus.inputs, iterations);
+    printf("%-14s %12.3f %12.3f %8.1fx\n", corpus.name, legacy, simd,
+           legacy / simd);
+  }
+  return 0;
+}